@@ -0,0 +1,89 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+#define MAX_FDS 1024  // sockets whose port is remembered
+
+static int captureFD = -1;
+static char* buffer;
+static size_t used;
+static uint64_t lastWrite;
+static uint16_t portOf[MAX_FDS];  // 0 until looked up
+
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint16_t localPort(int sock) {
+	if (sock >= 0 && sock < MAX_FDS && portOf[sock]) return portOf[sock];
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(sock, (struct sockaddr*) &addr, &len)) return 0;
+	uint16_t port = ntohs(addr.sin_port);
+	if (sock >= 0 && sock < MAX_FDS) portOf[sock] = port;
+	return port;
+}
+
+void captureFlush() {
+	if (captureFD < 0 || !used) return;
+	if (write(captureFD, buffer, used) != used) perror("Writing capture");
+	used = 0;
+}
+
+int captureEnabled() {
+	return captureFD >= 0;
+}
+
+void captureDatagram(int sock, const void* buf, int len, const struct sockaddr_in* from) {
+	if (captureFD < 0) return;
+	const size_t size = sizeof(struct captureRecord) + len;
+	if (used + size > BUFFER_SIZE) captureFlush();
+
+	struct captureRecord rec;
+	memset(&rec, 0, sizeof(rec));
+	rec.time = nowNs();
+	rec.srcAddr = from->sin_addr.s_addr;
+	rec.srcPort = from->sin_port;
+	rec.dstPort = localPort(sock);
+	rec.len = len;
+	memcpy(buffer + used, &rec, sizeof(rec));
+	memcpy(buffer + used + sizeof(rec), buf, len);
+	used += size;
+
+	if (rec.time - lastWrite > CAPTURE_FLUSH_MS * 1000000ULL) {
+		captureFlush();
+		lastWrite = rec.time;
+	}
+}
+
+void captureInit(unsigned long port, const char* fileName) {
+	const char* want = getenv("TXCAPTURE");
+	if (!want || !atoi(want)) return;
+
+	buffer = malloc(BUFFER_SIZE);
+	captureFD = open(fileName, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if (!buffer || captureFD < 0) {
+		perror("Opening capture file");
+		captureFD = -1;
+		return;
+	}
+	struct stat st;
+	if (fstat(captureFD, &st) == 0 && st.st_size == 0) {
+		struct captureHeader hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+		hdr.port = port;
+		if (write(captureFD, &hdr, sizeof(hdr)) != sizeof(hdr)) perror("Writing capture");
+	}
+	atexit(captureFlush);
+}
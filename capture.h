@@ -0,0 +1,48 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H 1
+#include <netinet/in.h>
+#include <stdint.h>
+
+// Recording of received traffic for txreplay. With TXCAPTURE=1 in the
+// environment, every datagram a process receives through txio, over UDP or
+// shared memory, is appended to its capture file together with when it
+// arrived, who sent it and on which port. Records are buffered and written
+// out every CAPTURE_FLUSH_MS, when the buffer fills up and at exit.
+
+#define CAPTURE_MAGIC "TXCAPT01"
+#define CAPTURE_FLUSH_MS 100
+
+struct captureHeader {
+	char magic[8];
+	uint32_t port;  // port the process is named after
+	uint32_t pad;
+};
+
+// Followed by len bytes of the datagram.
+struct captureRecord {
+	uint64_t time;     // ns since the epoch
+	uint32_t srcAddr;  // network byte order
+	uint16_t srcPort;  // network byte order
+	uint16_t dstPort;  // port of the receiving socket
+	uint32_t len;
+	uint32_t pad;
+};
+
+/**
+ * Start capturing to fileName if TXCAPTURE is set to a nonzero value.
+ */
+void captureInit(unsigned long port, const char* fileName);
+
+int captureEnabled(void);
+
+/**
+ * Record a datagram of len bytes that arrived on sock from from.
+ */
+void captureDatagram(int sock, const void* buf, int len, const struct sockaddr_in* from);
+
+/**
+ * Write out everything recorded so far. Called before injected crashes.
+ */
+void captureFlush(void);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,35 @@
+#include "checksum.h"
+
+#define CRC32C_POLY 0x82f63b78u  // reflected
+
+static uint32_t table[8][256];
+static int tableReady;
+
+static void buildTable() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) table[t][i] = (table[t - 1][i] >> 8) ^ table[0][table[t - 1][i] & 0xff];
+	}
+	tableReady = 1;
+}
+
+/**
+ * Slicing by 8: eight bytes per step, one table lookup per byte.
+ */
+uint32_t checksum(uint32_t crc, const void* p, size_t len) {
+	if (!tableReady) buildTable();
+	const unsigned char* b = p;
+	crc = ~crc;
+	for (; len >= 8; len -= 8, b += 8) {
+		const uint32_t lo = crc ^ ((uint32_t) b[0] | (uint32_t) b[1] << 8 | (uint32_t) b[2] << 16 |
+			(uint32_t) b[3] << 24);
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^
+			table[4][lo >> 24] ^ table[3][b[4]] ^ table[2][b[5]] ^ table[1][b[6]] ^ table[0][b[7]];
+	}
+	while (len--) crc = (crc >> 8) ^ table[0][(crc ^ *b++) & 0xff];
+	return ~crc;
+}
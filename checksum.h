@@ -0,0 +1,13 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H 1
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C over the durable records of the logs, so that a record that only
+// partly reached the disk before a machine crash is noticed on recovery.
+// Records are checksummed field by field: start with crc 0 and feed the
+// result of each call into the next.
+
+uint32_t checksum(uint32_t crc, const void* p, size_t len);
+
+#endif /* CHECKSUM_H */
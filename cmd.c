@@ -7,6 +7,7 @@
 #include <arpa/inet.h> 
 #include <netinet/in.h> 
 #include <errno.h>
+#include <sys/time.h>
 #include <time.h>
 #include <netdb.h>
 #include <sys/types.h>
@@ -15,8 +16,9 @@
 
 
 #include "msg.h"
+#include "txclient.h"
 
-void sendmessage(char * hostname, char * port, msgType * msg) {
+void sendpacket(char * hostname, char * port, void * msg, int len) {
 	
   int sockfd;
   struct addrinfo h1;
@@ -49,7 +51,7 @@ void sendmessage(char * hostname, char * port, msgType * msg) {
         exit(1);
     }
   
-  if ((numbytes = sendto(sockfd, msg, sizeof(msgType), 0, p->ai_addr, p->ai_addrlen)) == -1) {
+  if ((numbytes = sendto(sockfd, msg, len, 0, p->ai_addr, p->ai_addrlen)) == -1) {
     perror("talker: sendto");
     exit(1);
     }
@@ -58,6 +60,172 @@ void sendmessage(char * hostname, char * port, msgType * msg) {
     close(sockfd);
 }
 
+void sendmessage(char * hostname, char * port, msgType * msg) {
+  sendpacket(hostname, port, msg, sizeof(msgType));
+}
+
+// Send a NEW_VALUE: the value follows the command in the same datagram.
+void sendvalue(char * hostname, char * port, msgType * msg, char * value) {
+  int len = strlen(value);
+  if (len > VALUE_MAX) {
+    printf("error: values are at most %d bytes\n", VALUE_MAX);
+    exit(1);
+  }
+  char * packet = malloc(sizeof(msgType) + len);
+  msg->msgID = NEW_VALUE;
+  msg->newValue = len;
+  memcpy(packet, msg, sizeof(msgType));
+  memcpy(packet + sizeof(msgType), value, len);
+  sendpacket(hostname, port, packet, sizeof(msgType) + len);
+  free(packet);
+}
+
+// Send a READ and print the committed values from the reply.
+void readvalues(char * hostname, char * port) {
+  struct addrinfo hints, *servinfo;
+  int sockfd;
+  int rv;
+  msgType msg;
+  struct {
+    replyType reply;
+    char value[VALUE_MAX];
+  } packet;
+  replyType * reply = &packet.reply;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  if ((rv = getaddrinfo(hostname, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    exit(1);
+  }
+  if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) == -1) {
+    perror("talker: socket");
+    exit(1);
+  }
+
+  struct timeval timeout = { 2, 0 };
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msgID = READ;
+  if (sendto(sockfd, &msg, sizeof(msg), 0, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+    perror("talker: sendto");
+    exit(1);
+  }
+  rv = recv(sockfd, &packet, sizeof(packet), 0);
+  if (rv < (int) sizeof(replyType) || reply->msgID != READ
+      || rv != sizeof(replyType) + reply->valueLen) {
+    fprintf(stderr, "no reply from %s:%s\n", hostname, port);
+    exit(1);
+  }
+  printf("A=%d B=%d id=%s", reply->A, reply->B, reply->IDstring);
+  if (reply->txState != WTX_NOTACTIVE) {
+    printf(" (transaction %u in progress, state %u)", reply->tid, reply->txState);
+  }
+  printf("\n");
+  if (reply->valueLen) printf("value (%u bytes): %.*s\n", reply->valueLen, (int) reply->valueLen, packet.value);
+
+  freeaddrinfo(servinfo);
+  close(sockfd);
+}
+
+void printport(const char * name, const struct portStats * stats) {
+  printf("%s received %llu dropped %llu depth %u max depth %u\n", name,
+         (unsigned long long) stats->received, (unsigned long long) stats->dropped,
+         stats->depth, stats->maxDepth);
+}
+
+// Send a STATS and print the worker's receive queue counters.
+void readstats(char * hostname, char * port) {
+  struct addrinfo hints, *servinfo;
+  int sockfd;
+  int rv;
+  msgType msg;
+  statsType reply;
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  if ((rv = getaddrinfo(hostname, port, &hints, &servinfo)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    exit(1);
+  }
+  if ((sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol)) == -1) {
+    perror("talker: socket");
+    exit(1);
+  }
+
+  struct timeval timeout = { 2, 0 };
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msgID = STATS;
+  if (sendto(sockfd, &msg, sizeof(msg), 0, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+    perror("talker: sendto");
+    exit(1);
+  }
+  rv = recv(sockfd, &reply, sizeof(reply), 0);
+  if (rv != sizeof(reply) || reply.msgID != STATS) {
+    fprintf(stderr, "no reply from %s:%s\n", hostname, port);
+    exit(1);
+  }
+  printport("command port:", &reply.cmdPort);
+  printport("tx port:     ", &reply.txPort);
+
+  freeaddrinfo(servinfo);
+  close(sockfd);
+}
+
+// Send a COMMIT or ABORT and wait for the outcome of the transaction.
+void finishwait(char * hostname, char * port, int commit, uint32_t tid) {
+  struct sockaddr_in worker;
+  if (txcResolve(hostname, atoi(port), &worker)) {
+    fprintf(stderr, "cannot resolve %s\n", hostname);
+    exit(1);
+  }
+  struct txcClient * client = txcOpen();
+  if (!client) {
+    perror("txcOpen");
+    exit(1);
+  }
+  struct txcOp * op = commit ? txcCommit(client, &worker, tid, NULL, NULL)
+                             : txcAbort(client, &worker, tid, NULL, NULL);
+  enum txcStatus status = txcWait(client, op);
+  printf("transaction %u %s after %.1f ms\n", txcTid(op), txcStatusName(status), txcLatency(op));
+  txcRelease(op);
+  txcClose(client);
+  exit(status == TXC_COMMITTED || (!commit && status == TXC_ABORTED) ? 0 : 1);
+}
+
+// Send a BEGINTX without a tid and print the one the worker got from the
+// manager once the transaction has started.
+void beginleased(char * hostname, char * port, char * manager, char * managerport) {
+  struct sockaddr_in worker;
+  if (txcResolve(hostname, atoi(port), &worker)) {
+    fprintf(stderr, "cannot resolve %s\n", hostname);
+    exit(1);
+  }
+  struct txcClient * client = txcOpen();
+  if (!client) {
+    perror("txcOpen");
+    exit(1);
+  }
+  struct txcOp * op = txcBegin(client, &worker, manager, atoi(managerport), 0, NULL, NULL);
+  while (txcStatus(op) == TXC_PENDING && !txcTid(op)) {
+    txcPoll(client, 100);
+  }
+  if (txcStatus(op) != TXC_PENDING) {
+    printf("transaction %u %s\n", txcTid(op), txcStatusName(txcStatus(op)));
+    exit(1);
+  }
+  printf("transaction %u started\n", txcTid(op));
+  txcClose(client);
+  exit(0);
+}
+
 int main(int argc, char ** argv) {
   
   msgType * msg;
@@ -73,8 +241,11 @@ int main(int argc, char ** argv) {
   
   // parse command
   if (strcmp(argv[1], "begin") == 0) {
+    if (argc < 7 || strtoul(argv[6], NULL, 10) == 0) {
+      beginleased(argv[2], argv[3], argv[4], argv[5]);
+    }
     msg->msgID = BEGINTX;
-    msg->tid = atoi(argv[6]);
+    msg->tid = strtoul(argv[6], NULL, 10);
     msg->port = atoi(argv[5]);
     strncpy((msg->strData).hostName, argv[4], strlen(argv[4]));
       printf("here: %s\n", (msg->strData).hostName);
@@ -82,7 +253,7 @@ int main(int argc, char ** argv) {
   }
   else if (strcmp(argv[1], "join") == 0) {
     msg->msgID = JOINTX;
-    msg->tid = atoi(argv[6]);
+    msg->tid = strtoul(argv[6], NULL, 10);
     msg->port = atoi(argv[5]);
     strncpy((msg->strData).hostName, argv[4], strlen(argv[4]));
     printf("here: %s\n", (msg->strData).hostName);
@@ -132,6 +303,54 @@ int main(int argc, char ** argv) {
     msg->msgID = VOTE_ABORT;
       sendmessage(argv[2], argv[3], msg);
   }
+  else if (strcmp(argv[1], "commitwait") == 0) {
+    finishwait(argv[2], argv[3], 1, argc > 4 ? strtoul(argv[4], NULL, 10) : 0);
+  }
+  else if (strcmp(argv[1], "abortwait") == 0) {
+    finishwait(argv[2], argv[3], 0, argc > 4 ? strtoul(argv[4], NULL, 10) : 0);
+  }
+  else if (strcmp(argv[1], "value") == 0) {
+    sendvalue(argv[2], argv[3], msg, argv[4]);
+  }
+  else if (strcmp(argv[1], "read") == 0) {
+    readvalues(argv[2], argv[3]);
+  }
+  else if (strcmp(argv[1], "stats") == 0) {
+    readstats(argv[2], argv[3]);
+  }
+  else if (strcmp(argv[1], "batch") == 0) {
+    // batch host port a=1 b=2 id=foo ...
+    msg->msgID = NEW_BATCH;
+    msg->strData.batch.count = 0;
+    int haveid = 0;  // every id= op writes the one batch.newID
+    for (int i = 4; i < argc; i++) {
+      int n = msg->strData.batch.count;
+      if (n == MAX_BATCH) {
+        printf("error: at most %d writes per batch\n", MAX_BATCH);
+        exit(1);
+      }
+      if (strncmp(argv[i], "a=", 2) == 0) {
+        msg->strData.batch.ops[n].field = FIELD_A;
+        msg->strData.batch.ops[n].value = atoi(argv[i] + 2);
+      } else if (strncmp(argv[i], "b=", 2) == 0) {
+        msg->strData.batch.ops[n].field = FIELD_B;
+        msg->strData.batch.ops[n].value = atoi(argv[i] + 2);
+      } else if (strncmp(argv[i], "id=", 3) == 0) {
+        if (haveid) {
+          printf("error: at most one id= write per batch\n");
+          exit(1);
+        }
+        haveid = 1;
+        msg->strData.batch.ops[n].field = FIELD_IDSTR;
+        strncpy(msg->strData.batch.newID, argv[i] + 3, IDLEN - 1);
+      } else {
+        printf("error: batch writes look like a=1, b=2 or id=text\n");
+        exit(1);
+      }
+      msg->strData.batch.count++;
+    }
+    sendmessage(argv[2], argv[3], msg);
+  }
   else {
     printf("error: not a valid command\n");
   }
@@ -0,0 +1,391 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checksum.h"
+
+// Log durability microbenchmark. Writes fixed-size records to a scratch file
+// with one sync strategy after the other and reports per-record latency,
+// measured from the start of the write until the sync covering the record
+// returned, and throughput. The file is created in the current directory
+// (or -d dir) so the numbers are for the filesystem the logs live on.
+
+#define DEFAULT_RECORDS 1000
+#define DEFAULT_RECORD_SIZE 512
+#define MAX_BATCHES 8
+#define BENCH_FILE "logbench.tmp"
+
+struct bench {
+	int records;
+	int size;
+	int batch;      // records per sync, for the batched strategies
+	char* record;
+	double* latency;  // seconds, one entry per record
+};
+
+struct strategy {
+	const char* name;
+	const char* description;
+	int batched;  // run once per batch size
+	double (*run)(struct bench* b);  // returns elapsed seconds, < 0 on error
+};
+
+static int batchSizes[MAX_BATCHES] = { 4, 16, 64 };
+static int numBatchSizes = 3;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int openBench(int flags) {
+	unlink(BENCH_FILE);
+	int fd = open(BENCH_FILE, O_RDWR | O_CREAT | flags, S_IRUSR | S_IWUSR);
+	if (fd < 0) perror("Opening " BENCH_FILE);
+	return fd;
+}
+
+/**
+ * Write zeros over the whole file and make them durable, so the timed
+ * writes neither allocate blocks nor convert unwritten extents.
+ */
+static int preallocate(int fd, const struct bench* b) {
+	char* zeros = calloc(1, b->size);
+	for (int i = 0; i < b->records; i++) {
+		if (pwrite(fd, zeros, b->size, (off_t) i * b->size) != b->size) {
+			perror("Preallocating");
+			free(zeros);
+			return -1;
+		}
+	}
+	free(zeros);
+	return fsync(fd);
+}
+
+static int writeRecord(int fd, const struct bench* b, int i) {
+	b->record[0] = i;
+	if (pwrite(fd, b->record, b->size, (off_t) i * b->size) != b->size) {
+		perror("Writing record");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Size the scratch file for every record and map it in, the way tmanager and
+ * tworker map their logs. Returns NULL on error.
+ */
+static char* mapBench(const struct bench* b, int* fd) {
+	*fd = openBench(O_SYNC);
+	if (*fd < 0) return NULL;
+	const size_t len = (size_t) b->records * b->size;
+	if (ftruncate(*fd, len)) {
+		perror("Sizing " BENCH_FILE);
+		close(*fd);
+		return NULL;
+	}
+	char* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (base == MAP_FAILED) {
+		perror("Mapping " BENCH_FILE);
+		close(*fd);
+		return NULL;
+	}
+	return base;
+}
+
+static void unmapBench(const struct bench* b, char* base, int fd) {
+	munmap(base, (size_t) b->records * b->size);
+	close(fd);
+}
+
+/**
+ * Copy record i into the mapping with a checksum in its last four bytes,
+ * as the processes checksum their log records before each flush.
+ */
+static void putRecord(char* base, const struct bench* b, int i) {
+	char* rec = base + (size_t) i * b->size;
+	b->record[0] = i;
+	memcpy(rec, b->record, b->size);
+	if (b->size >= 8) {
+		const uint32_t crc = checksum(0, rec, b->size - 4);
+		memcpy(rec + b->size - 4, &crc, 4);
+	}
+}
+
+static int syncRecords(char* base, const struct bench* b, int first, int last) {
+	const long page = sysconf(_SC_PAGESIZE);
+	const size_t off = (size_t) first * b->size;
+	const size_t aligned = off & ~(page - 1);
+	if (msync(base + aligned, (size_t) last * b->size - aligned, MS_SYNC | MS_INVALIDATE)) {
+		perror("msync");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * TXIO_DURABILITY=strict: the log is an O_SYNC file mapped into memory, and
+ * every change is followed by msync(MS_SYNC | MS_INVALIDATE) of the pages
+ * it touched.
+ */
+static double runMsync(struct bench* b) {
+	int fd;
+	char* base = mapBench(b, &fd);
+	if (!base) return -1;
+	const double start = now();
+	for (int i = 0; i < b->records; i++) {
+		const double t = now();
+		putRecord(base, b, i);
+		if (syncRecords(base, b, i, i + 1)) break;
+		b->latency[i] = now() - t;
+	}
+	const double elapsed = now() - start;
+	unmapBench(b, base, fd);
+	return elapsed;
+}
+
+/**
+ * TXIO_DURABILITY=group: b->batch records go into the mapping, then one
+ * msync covers them all. A record's latency runs until that sync returns:
+ * it is how long the record could have been lost to a machine crash, since
+ * replies do not wait for the sync in this mode.
+ */
+static double runGroup(struct bench* b) {
+	int fd;
+	char* base = mapBench(b, &fd);
+	if (!base) return -1;
+	const double start = now();
+	for (int first = 0; first < b->records; first += b->batch) {
+		const int last = first + b->batch < b->records ? first + b->batch : b->records;
+		for (int i = first; i < last; i++) {
+			b->latency[i] = now();
+			putRecord(base, b, i);
+		}
+		if (syncRecords(base, b, first, last)) break;
+		const double t = now();
+		for (int i = first; i < last; i++) b->latency[i] = t - b->latency[i];
+	}
+	const double elapsed = now() - start;
+	unmapBench(b, base, fd);
+	return elapsed;
+}
+
+/**
+ * TXIO_DURABILITY=os: records go into the mapping and are never synced.
+ */
+static double runOS(struct bench* b) {
+	int fd;
+	char* base = mapBench(b, &fd);
+	if (!base) return -1;
+	const double start = now();
+	for (int i = 0; i < b->records; i++) {
+		const double t = now();
+		putRecord(base, b, i);
+		b->latency[i] = now() - t;
+	}
+	const double elapsed = now() - start;
+	unmapBench(b, base, fd);
+	return elapsed;
+}
+
+static double runPwriteFdatasync(struct bench* b) {
+	int fd = openBench(0);
+	if (fd < 0) return -1;
+	const double start = now();
+	for (int i = 0; i < b->records; i++) {
+		const double t = now();
+		if (writeRecord(fd, b, i) || fdatasync(fd)) break;
+		b->latency[i] = now() - t;
+	}
+	const double elapsed = now() - start;
+	close(fd);
+	return elapsed;
+}
+
+static double runODsync(struct bench* b) {
+	int fd = openBench(O_DSYNC | O_APPEND);
+	if (fd < 0) return -1;
+	const double start = now();
+	for (int i = 0; i < b->records; i++) {
+		const double t = now();
+		b->record[0] = i;
+		if (write(fd, b->record, b->size) != b->size) {
+			perror("Appending record");
+			break;
+		}
+		b->latency[i] = now() - t;
+	}
+	const double elapsed = now() - start;
+	close(fd);
+	return elapsed;
+}
+
+static double runPrealloc(struct bench* b) {
+	int fd = openBench(0);
+	if (fd < 0) return -1;
+	if (preallocate(fd, b)) {
+		close(fd);
+		return -1;
+	}
+	const double start = now();
+	for (int i = 0; i < b->records; i++) {
+		const double t = now();
+		if (writeRecord(fd, b, i) || fdatasync(fd)) break;
+		b->latency[i] = now() - t;
+	}
+	const double elapsed = now() - start;
+	close(fd);
+	return elapsed;
+}
+
+/**
+ * Group commit: b->batch records are written to a preallocated file and
+ * made durable by one fdatasync. A record's latency runs until that sync
+ * returns, the way a durable send waits for its flush.
+ */
+static double runBatched(struct bench* b) {
+	int fd = openBench(0);
+	if (fd < 0) return -1;
+	if (preallocate(fd, b)) {
+		close(fd);
+		return -1;
+	}
+	const double start = now();
+	for (int first = 0; first < b->records; first += b->batch) {
+		const int last = first + b->batch < b->records ? first + b->batch : b->records;
+		for (int i = first; i < last; i++) {
+			b->latency[i] = now();
+			if (writeRecord(fd, b, i)) break;
+		}
+		if (fdatasync(fd)) {
+			perror("fdatasync");
+			break;
+		}
+		const double t = now();
+		for (int i = first; i < last; i++) b->latency[i] = t - b->latency[i];
+	}
+	const double elapsed = now() - start;
+	close(fd);
+	return elapsed;
+}
+
+static struct strategy strategies[] = {
+	{ "msync", "O_SYNC mapping, msync per record (strict durability)", 0, runMsync },
+	{ "group", "O_SYNC mapping, one msync per batch (group durability)", 1, runGroup },
+	{ "os", "O_SYNC mapping, never synced (os durability)", 0, runOS },
+	{ "fdatasync", "pwrite + fdatasync per record, growing file", 0, runPwriteFdatasync },
+	{ "odsync", "O_DSYNC appends", 0, runODsync },
+	{ "prealloc", "pwrite + fdatasync per record, preallocated file", 0, runPrealloc },
+	{ "batch", "pwrite, one fdatasync per batch, preallocated file", 1, runBatched }
+};
+
+#define NUM_STRATEGIES (sizeof(strategies) / sizeof(strategies[0]))
+
+static int byValue(const void* a, const void* b) {
+	const double x = *(const double*) a;
+	const double y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, struct bench* b, double elapsed) {
+	double sum = 0;
+	for (int i = 0; i < b->records; i++) sum += b->latency[i];
+	qsort(b->latency, b->records, sizeof(double), byValue);
+	printf("%-14s %10.1f %10.1f %10.1f %10.1f %12.0f\n", name, sum / b->records * 1e6,
+		b->latency[b->records / 2] * 1e6, b->latency[b->records * 99 / 100] * 1e6,
+		b->latency[b->records - 1] * 1e6, b->records / elapsed);
+}
+
+static void runStrategy(const struct strategy* s, struct bench* b) {
+	char name[32];
+	memset(b->latency, 0, b->records * sizeof(double));
+	const double elapsed = s->run(b);
+	unlink(BENCH_FILE);
+	if (s->batched) snprintf(name, sizeof(name), "%s-%d", s->name, b->batch);
+	else snprintf(name, sizeof(name), "%s", s->name);
+	if (elapsed < 0) printf("%-14s failed\n", name);
+	else report(name, b, elapsed);
+}
+
+static void usage(char* cmd) {
+	printf("usage: %s [-d dir] [-n records] [-s size] [-b batch,...] [strategy...]\n", cmd);
+	printf("  -d dir    directory to put the scratch file in (default .)\n");
+	printf("  -n count  records per strategy (default %d)\n", DEFAULT_RECORDS);
+	printf("  -s bytes  record size (default %d)\n", DEFAULT_RECORD_SIZE);
+	printf("  -b list   batch sizes for the batch and group strategies (default 4,16,64)\n");
+	printf("strategies:\n");
+	for (int i = 0; i < NUM_STRATEGIES; i++) {
+		printf("  %-10s %s\n", strategies[i].name, strategies[i].description);
+	}
+}
+
+static void parseBatchSizes(char* list) {
+	numBatchSizes = 0;
+	for (char* tok = strtok(list, ","); tok && numBatchSizes < MAX_BATCHES; tok = strtok(NULL, ",")) {
+		int n = atoi(tok);
+		if (n > 0) batchSizes[numBatchSizes++] = n;
+	}
+}
+
+int main(int argc, char** argv) {
+	struct bench b = { DEFAULT_RECORDS, DEFAULT_RECORD_SIZE, 1 };
+	const char* dir = ".";
+	int opt;
+	while ((opt = getopt(argc, argv, "d:n:s:b:h")) != -1) {
+		switch (opt) {
+			case 'd':
+				dir = optarg;
+				break;
+			case 'n':
+				b.records = atoi(optarg);
+				break;
+			case 's':
+				b.size = atoi(optarg);
+				break;
+			case 'b':
+				parseBatchSizes(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (b.records < 1 || b.size < 1) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (chdir(dir)) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	b.record = malloc(b.size);
+	b.latency = malloc(b.records * sizeof(double));
+	memset(b.record, 'x', b.size);
+
+	printf("%d records of %d bytes in %s\n\n", b.records, b.size, dir);
+	printf("%-14s %10s %10s %10s %10s %12s\n", "strategy", "avg us", "p50 us", "p99 us",
+		"max us", "records/s");
+	for (int i = 0; i < NUM_STRATEGIES; i++) {
+		int selected = optind == argc;
+		for (int a = optind; a < argc; a++) {
+			if (strcmp(argv[a], strategies[i].name) == 0) selected = 1;
+		}
+		if (!selected) continue;
+		if (!strategies[i].batched) {
+			b.batch = 1;
+			runStrategy(&strategies[i], &b);
+			continue;
+		}
+		for (int j = 0; j < numBatchSizes; j++) {
+			b.batch = batchSizes[j];
+			runStrategy(&strategies[i], &b);
+		}
+	}
+	return EXIT_SUCCESS;
+}
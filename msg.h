@@ -1,5 +1,6 @@
 #ifndef MSG_H
 #define MSG_H 1
+#include <stddef.h>
 #include <stdint.h>
 #include "tworker.h"
 
@@ -8,6 +9,7 @@
 // and transaction manager that is a design decision for the implementator.
 
 #define HOSTLEN 512
+#define MAX_BATCH 16
 
 enum cmdMsgKind {
     BEGINTX = 1000,
@@ -21,7 +23,19 @@ enum cmdMsgKind {
     COMMIT_CRASH,
     ABORT,
     ABORT_CRASH,
-    VOTE_ABORT
+    VOTE_ABORT,
+    READ,
+    NEW_BATCH,
+    NEW_VALUE,
+    OUTCOME,  // worker to client, see outcomeType; never a command
+    STATS     // answered with a statsType
+};
+
+// Fields a NEW_BATCH command can write
+enum batchField {
+    FIELD_A = 1,
+    FIELD_B,
+    FIELD_IDSTR
 };
 
 enum txMsgKind {
@@ -38,28 +52,116 @@ enum txMsgKind {
     TXMSG_VOTE_ABORT,
     TXMSG_COMMITTED,
     TXMSG_POLL_RESULT,
-    TXMSG_ABORTED
+    TXMSG_ABORTED,
+    TXMSG_BUSY,  // no room for a BEGIN; arg: ms to wait before retrying
+    TXMSG_DONE,  // worker applied COMMITTED, the manager may forget the tid
+    TXMSG_DECISION_REQUEST,  // in-doubt worker asks a peer for the outcome
+    TXMSG_HEARTBEAT,  // worker is alive and still waiting for the outcome
+    TXMSG_LEASE_REQUEST,  // worker asks for arg tids of its own
+    TXMSG_LEASE_GRANT     // tids tid to tid+arg-1 are the worker's to begin with
 };
 
 typedef struct {
     uint32_t tid;
     uint32_t type;
+    uint32_t arg;  // depends on type, 0 if unused; for TXMSG_VOTE_COMMIT
+                   // the number of participants the vote speaks for, for
+                   // TXMSG_COMMIT_REQUEST 1 if the requester votes yes with it
 } managerType;
 
+// PREPARE_TO_COMMIT. It lists every participant so that an in-doubt worker
+// can ask its peers for the outcome. With a fanout the participants also
+// form a tree with the manager at the root and fanout children per node:
+// participant i forwards the message, with hdr.arg set to the child's index,
+// to participants TREE_CHILD(fanout, i, 0..fanout-1) and answers whoever
+// sent it with a single vote for its whole subtree. The manager's children
+// are TREE_CHILD(fanout, -1, j). With fanout 0 the manager sends it to every
+// participant. Only the first count participants are sent.
+typedef struct {
+    managerType hdr;  // hdr.arg: index of the recipient
+    uint32_t fanout;
+    uint32_t count;
+    struct peerAddr participants[MAX_PARTICIPANTS];
+} prepareType;
+
+#define MAX_FANOUT 64  // children per node, one bit each in a vote mask
+#define TREE_CHILD(fanout, index, j) ((fanout) * ((index) + 1) + (j))
+#define PREPARE_SIZE(count) \
+    (offsetof(prepareType, participants) + (count) * sizeof(((prepareType*) 0)->participants[0]))
+
 // The following is not the best approach/format for the command messages
 // but it is simple and it will fit in one packet. Which fields have
 // usable values will depend upon the type of the command message.
 
 typedef struct {
     uint32_t msgID;
-    uint32_t tid;  // Transaction ID
+    uint32_t tid;  // Transaction ID; for BEGINTX 0 lets the worker take
+                   // one leased from the manager
     uint32_t port;
     int32_t newValue;  // New value for A or B
     int32_t delay;
     union {  // string data
         char newID[IDLEN];
         char hostName[HOSTLEN];
+        struct {  // NEW_BATCH: writes applied in order, all or none
+            uint32_t count;
+            struct {
+                uint32_t field;  // enum batchField
+                int32_t value;   // unused for FIELD_IDSTR
+            } ops[MAX_BATCH];
+            char newID[IDLEN];   // value written by FIELD_IDSTR ops
+        } batch;
     } strData;
+    uint32_t notify;  // BEGINTX, JOINTX, COMMIT, ABORT: nonzero to get an
+                      // outcomeType back once the transaction has ended
 } msgType;
 
+// A NEW_VALUE command sets the worker's variable-length value: the
+// datagram is a msgType whose newValue is the length, followed by that many
+// bytes (at most VALUE_MAX).
+
+// Reply to a READ command, sent back to the address the command came from.
+// The values are the last committed ones; writes of a transaction that is
+// still in progress are not visible. valueLen bytes of the variable-length
+// value follow the reply in the same datagram.
+
+// Sent from the worker's command port to the address a command with notify
+// set came from. A COMMIT or ABORT that names a tid the worker is no longer
+// in (tid 0 means the current one) is answered right away from the
+// worker's recent decisions.
+typedef struct {
+    uint32_t msgID;    // OUTCOME
+    uint32_t tid;
+    uint32_t outcome;  // TXMSG_COMMITTED or TXMSG_ABORTED; TXMSG_TID_BAD if
+                       // a BEGINTX/JOINTX found the worker busy; 0 if unknown.
+                       // TXMSG_TID_OK is no outcome: the transaction of a
+                       // BEGINTX/JOINTX started, with this tid
+} outcomeType;
+
+typedef struct {
+    uint32_t msgID;    // READ
+    uint32_t tid;      // transaction the worker is in, if txState is not WTX_NOTACTIVE
+    uint32_t txState;
+    int32_t A;
+    int32_t B;
+    char IDstring[IDLEN];
+    uint32_t valueLen;
+} replyType;
+
+// Reply to a STATS command: the counters of the worker's receive queues, one
+// per port. All 0 when the worker receives inline (TXIO_RECV=inline).
+struct portStats {
+    uint64_t received;  // datagrams queued
+    uint64_t dropped;   // datagrams lost to a full queue
+    uint32_t depth;     // queued and not handled yet
+    uint32_t maxDepth;  // deepest the queue has been
+};
+
+typedef struct {
+    uint32_t msgID;  // STATS
+    uint32_t pad;
+    struct portStats cmdPort;
+    struct portStats txPort;
+} statsType;
+
 #endif
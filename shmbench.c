@@ -0,0 +1,191 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "txio.h"
+
+// Round-trip benchmark for datagrams between two processes on this host,
+// once over loopback UDP and once over the shared-memory rings. A pinger
+// sends managerType-sized messages to an echo process through txio and
+// times each reply.
+
+#define DEFAULT_ROUNDS 10000
+#define DEFAULT_PORT 9700
+#define WARMUP_ROUNDS 100
+#define REPLY_TIMEOUT 0.1  // seconds before a lost datagram is sent again
+
+static int rounds = DEFAULT_ROUNDS;
+static int size = sizeof(managerType);
+static unsigned short basePort = DEFAULT_PORT;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct sockaddr_in localAddr(unsigned short port) {
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	return addr;
+}
+
+/**
+ * Bind a socket to port and hand it to txio, with the shared-memory path
+ * on or off.
+ */
+static int openEndpoint(unsigned short port, int shm) {
+	setenv("TXIO_SHM", shm ? "on" : "off", 1);
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr = localAddr(port);
+	if (sock < 0 || bind(sock, (struct sockaddr*) &addr, sizeof(addr))) {
+		perror("Binding benchmark socket");
+		exit(EXIT_FAILURE);
+	}
+	txioInit(-1, NULL, 0);
+	txioWatch(sock);
+	return sock;
+}
+
+static volatile sig_atomic_t stopping;
+
+static void stopEcho(int sig) {
+	stopping = 1;
+}
+
+/**
+ * Send every datagram back until SIGTERM, then exit normally so the inbox
+ * is removed.
+ */
+static void echo(int shm, int ready) {
+	signal(SIGTERM, stopEcho);
+	int sock = openEndpoint(basePort + 2 * shm + 1, shm);
+	if (write(ready, "", 1) != 1) exit(EXIT_FAILURE);
+	char buf[TXIO_MAX_DATAGRAM];
+	while (!stopping) {
+		struct sockaddr_in from;
+		int n = txioRecv(sock, buf, sizeof(buf), &from);
+		if (n < 0) {
+			sched_yield();
+			continue;
+		}
+		txioSend(sock, buf, n, &from);
+		txioPoll();
+	}
+	exit(EXIT_SUCCESS);
+}
+
+static int byValue(const void* a, const void* b) {
+	const double x = *(const double*) a;
+	const double y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+static void ping(int shm) {
+	int sock = openEndpoint(basePort + 2 * shm, shm);
+	const struct sockaddr_in to = localAddr(basePort + 2 * shm + 1);
+	char* msg = calloc(1, size);
+	char buf[TXIO_MAX_DATAGRAM];
+	double* rtt = malloc(rounds * sizeof(double));
+	int resent = 0;
+
+	for (int i = -WARMUP_ROUNDS; i < rounds; i++) {
+		const double start = now();
+		double sent = start;
+		txioSend(sock, msg, size, &to);
+		while (txioRecv(sock, buf, sizeof(buf), NULL) < 0) {
+			txioPoll();
+			if (now() - sent > REPLY_TIMEOUT) {
+				txioSend(sock, msg, size, &to);
+				sent = now();
+				resent++;
+			}
+			sched_yield();
+		}
+		if (i >= 0) rtt[i] = now() - start;
+	}
+
+	double sum = 0;
+	for (int i = 0; i < rounds; i++) sum += rtt[i];
+	qsort(rtt, rounds, sizeof(double), byValue);
+	printf("%-14s %10.2f %10.2f %10.2f %10.2f %8d\n", shm ? "shared memory" : "loopback UDP",
+		sum / rounds * 1e6, rtt[rounds / 2] * 1e6, rtt[rounds * 99 / 100] * 1e6,
+		rtt[rounds - 1] * 1e6, resent);
+	fflush(stdout);
+}
+
+static void run(int shm) {
+	int ready[2];
+	char c;
+	if (pipe(ready)) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	fflush(stdout);
+	pid_t echoer = fork();
+	if (echoer == 0) echo(shm, ready[1]);
+	close(ready[1]);
+	if (read(ready[0], &c, 1) != 1) {
+		printf("Echo process did not start\n");
+		exit(EXIT_FAILURE);
+	}
+	pid_t pinger = fork();
+	if (pinger == 0) {
+		ping(shm);
+		exit(EXIT_SUCCESS);
+	}
+	waitpid(pinger, NULL, 0);
+	kill(echoer, SIGTERM);
+	waitpid(echoer, NULL, 0);
+	close(ready[0]);
+}
+
+static void usage(char* cmd) {
+	printf("usage: %s [-n rounds] [-s bytes] [-p port]\n", cmd);
+	printf("  -n rounds  round trips per transport (default %d)\n", DEFAULT_ROUNDS);
+	printf("  -s bytes   message size (default sizeof(managerType) = %zu)\n", sizeof(managerType));
+	printf("  -p port    ports used are port to port+3 (default %d)\n", DEFAULT_PORT);
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:s:p:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				rounds = atoi(optarg);
+				break;
+			case 's':
+				size = atoi(optarg);
+				break;
+			case 'p':
+				basePort = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (rounds < 1 || size < 1 || size > TXIO_MAX_DATAGRAM) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%d round trips of %d bytes\n\n", rounds, size);
+	printf("%-14s %10s %10s %10s %10s %8s\n", "transport", "avg us", "p50 us", "p99 us",
+		"max us", "resent");
+	run(0);
+	run(1);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,396 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+#define SHM_MAGIC "TXSHM001"
+#define SHM_WRAP 0xffffffffu  // record length that sends the reader back to the start
+#define MAX_LOCAL_ADDRS 16
+#define MAX_INBOXES 4         // inboxes of this process, one per watched socket
+#define MAX_PEERS 64          // destinations this process sends to
+#define PEER_RETRY_S 1.0      // how long a destination without an inbox is left alone
+
+// head and tail are byte positions that only ever grow; each is written by
+// one side only, and they live on separate cache lines.
+struct shmSlot {
+	uint64_t owner;  // (pid << 16) | port of the producer, 0 if free
+	char pad0[56];
+	uint64_t tail;   // written by the producer
+	char pad1[56];
+	uint64_t head;   // written by the consumer
+	char pad2[56];
+	char data[SHM_RING_SIZE];
+};
+
+struct shmInbox {
+	char magic[8];
+	uint32_t slots;
+	uint32_t ringSize;
+	int32_t pid;  // receiving process
+	char pad[44];
+	struct shmSlot slot[SHM_SLOTS];
+};
+
+// Every record starts 8-byte aligned.
+struct shmRecord {
+	uint32_t len;
+	uint32_t addr;  // destination address the sender used, network order
+};
+
+struct inbox {
+	int sock;
+	uint16_t port;
+	int next;  // slot to look at first, so no sender is starved
+	struct shmInbox* box;
+};
+
+struct peer {
+	uint32_t addr;     // network order
+	uint16_t port;     // host order
+	uint16_t fromPort;
+	struct shmInbox* box;  // NULL if the destination has no usable inbox
+	struct shmSlot* slot;
+	double retryAt;
+};
+
+static int enabled;
+static uint32_t localAddrs[MAX_LOCAL_ADDRS];
+static int numLocalAddrs;
+static struct inbox inboxes[MAX_INBOXES];
+static int numInboxes;
+static struct peer peers[MAX_PEERS];
+static int numPeers;
+static struct {
+	uint16_t port;
+	struct shmInbox* box;
+} mapped[MAX_PEERS];  // inboxes of other processes, mapped once each
+static int numMapped;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t recordSpace(uint32_t len) {
+	return sizeof(struct shmRecord) + ((len + 7) & ~7u);
+}
+
+static int alive(pid_t pid) {
+	return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+static uint16_t ownerPort(uint64_t owner) {
+	return owner & 0xffff;
+}
+
+static pid_t ownerPid(uint64_t owner) {
+	return owner >> 16;
+}
+
+static uint16_t boundPort(int sock) {
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(sock, (struct sockaddr*) &addr, &len)) return 0;
+	return ntohs(addr.sin_port);
+}
+
+/**
+ * Map the inbox of port, creating it if create is set. Returns NULL if
+ * there is none or it was made by an incompatible build.
+ */
+static struct shmInbox* mapInbox(uint16_t port, int create) {
+	char name[32];
+	snprintf(name, sizeof(name), "/txio.%u", port);
+	int fd = shm_open(name, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		if (create) perror("Creating shared memory inbox");
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || (st.st_size < sizeof(struct shmInbox)
+			&& (!create || ftruncate(fd, sizeof(struct shmInbox))))) {
+		close(fd);
+		return NULL;
+	}
+	struct shmInbox* box = mmap(NULL, sizeof(struct shmInbox), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (box == MAP_FAILED) return NULL;
+	if (create && memcmp(box->magic, SHM_MAGIC, sizeof(box->magic))) {
+		memset(box, 0, offsetof(struct shmInbox, slot));
+		for (int i = 0; i < SHM_SLOTS; i++) {
+			box->slot[i].owner = 0;
+			box->slot[i].head = box->slot[i].tail = 0;
+		}
+		box->slots = SHM_SLOTS;
+		box->ringSize = SHM_RING_SIZE;
+		memcpy(box->magic, SHM_MAGIC, sizeof(box->magic));
+	}
+	if (memcmp(box->magic, SHM_MAGIC, sizeof(box->magic)) || box->slots != SHM_SLOTS
+			|| box->ringSize != SHM_RING_SIZE) {
+		munmap(box, sizeof(struct shmInbox));
+		return NULL;
+	}
+	return box;
+}
+
+/**
+ * Remove the inboxes of this process at exit, so a clean run leaves nothing
+ * in /dev/shm. A pid of 0 tells senders still holding the old mapping to
+ * look the port up again. A crash leaves the inbox for the next incarnation
+ * to take over.
+ */
+static void unlinkInboxes() {
+	for (int i = 0; i < numInboxes; i++) {
+		int32_t pid = getpid();
+		if (!__atomic_compare_exchange_n(&inboxes[i].box->pid, &pid, 0, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED)) {
+			continue;  // a forked child exiting, not the receiver
+		}
+		char name[32];
+		snprintf(name, sizeof(name), "/txio.%u", inboxes[i].port);
+		shm_unlink(name);
+	}
+}
+
+void shmInit() {
+	const char* want = getenv("TXIO_SHM");
+	enabled = !(want && (strcmp(want, "off") == 0 || strcmp(want, "0") == 0));
+	if (!enabled) return;
+
+	localAddrs[numLocalAddrs++] = htonl(INADDR_LOOPBACK);
+	struct ifaddrs* ifs;
+	if (getifaddrs(&ifs)) return;
+	for (struct ifaddrs* i = ifs; i && numLocalAddrs < MAX_LOCAL_ADDRS; i = i->ifa_next) {
+		if (i->ifa_addr && i->ifa_addr->sa_family == AF_INET) {
+			localAddrs[numLocalAddrs++] = ((struct sockaddr_in*) i->ifa_addr)->sin_addr.s_addr;
+		}
+	}
+	freeifaddrs(ifs);
+}
+
+int shmEnabled() {
+	return enabled;
+}
+
+void shmWatch(int sock) {
+	if (!enabled) return;
+	if (numInboxes == MAX_INBOXES) {
+		printf("Too many sockets for shared memory inboxes\n");
+		exit(-1);
+	}
+	const uint16_t port = boundPort(sock);
+	struct shmInbox* box = mapInbox(port, 1);
+	if (!box) return;
+
+	// Whatever was queued for an earlier incarnation is dropped, as UDP
+	// would have, and rings of senders that died are handed back.
+	for (int i = 0; i < SHM_SLOTS; i++) {
+		struct shmSlot* s = &box->slot[i];
+		uint64_t owner = __atomic_load_n(&s->owner, __ATOMIC_ACQUIRE);
+		if (owner && !alive(ownerPid(owner))) {
+			__atomic_compare_exchange_n(&s->owner, &owner, 0, 0, __ATOMIC_ACQ_REL,
+				__ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&s->head, __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&box->pid, getpid(), __ATOMIC_RELEASE);
+
+	if (numInboxes == 0) atexit(unlinkInboxes);
+	inboxes[numInboxes].sock = sock;
+	inboxes[numInboxes].port = port;
+	inboxes[numInboxes].next = 0;
+	inboxes[numInboxes++].box = box;
+}
+
+int shmRecv(int sock, void* buf, int buflen, struct sockaddr_in* from) {
+	struct inbox* in = NULL;
+	for (int i = 0; i < numInboxes; i++) {
+		if (inboxes[i].sock == sock) in = &inboxes[i];
+	}
+	if (!in) return -1;
+
+	for (int n = 0; n < SHM_SLOTS; n++) {
+		const int idx = (in->next + n) % SHM_SLOTS;
+		struct shmSlot* s = &in->box->slot[idx];
+		uint64_t head = s->head;
+		const uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+		if (head == tail) continue;
+
+		uint32_t pos = head % SHM_RING_SIZE;
+		struct shmRecord* rec = (struct shmRecord*) (s->data + pos);
+		if (rec->len == SHM_WRAP) {
+			head += SHM_RING_SIZE - pos;
+			pos = 0;
+			rec = (struct shmRecord*) s->data;
+		}
+		if (head == tail || rec->len > SHM_RING_SIZE - pos - sizeof(*rec)) {
+			// nothing after the wrap, or a record a dead sender tore
+			__atomic_store_n(&s->head, tail, __ATOMIC_RELEASE);
+			continue;
+		}
+		const int len = rec->len;
+		memcpy(buf, rec + 1, len < buflen ? len : buflen);
+		if (from) {
+			memset(from, 0, sizeof(*from));
+			from->sin_family = AF_INET;
+			from->sin_addr.s_addr = rec->addr;
+			from->sin_port = htons(ownerPort(__atomic_load_n(&s->owner, __ATOMIC_ACQUIRE)));
+		}
+		__atomic_store_n(&s->head, head + recordSpace(len), __ATOMIC_RELEASE);
+		in->next = (idx + 1) % SHM_SLOTS;
+		return len;
+	}
+	return -1;
+}
+
+static int isLocal(uint32_t addr) {
+	if ((ntohl(addr) >> 24) == 127) return 1;
+	for (int i = 0; i < numLocalAddrs; i++) {
+		if (localAddrs[i] == addr) return 1;
+	}
+	return 0;
+}
+
+/**
+ * Find the ring this process owns in box for fromPort, claiming a free one
+ * or the one an earlier incarnation of the same port left behind.
+ */
+static struct shmSlot* claimSlot(struct shmInbox* box, uint16_t fromPort) {
+	const uint64_t self = ((uint64_t) getpid() << 16) | fromPort;
+	for (int i = 0; i < SHM_SLOTS; i++) {
+		uint64_t owner = __atomic_load_n(&box->slot[i].owner, __ATOMIC_ACQUIRE);
+		if (owner == self) return &box->slot[i];
+		if (owner && ownerPort(owner) == fromPort && !alive(ownerPid(owner))
+				&& __atomic_compare_exchange_n(&box->slot[i].owner, &owner, self, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return &box->slot[i];
+		}
+	}
+	for (int i = 0; i < SHM_SLOTS; i++) {
+		uint64_t owner = 0;
+		if (__atomic_compare_exchange_n(&box->slot[i].owner, &owner, self, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			return &box->slot[i];
+		}
+	}
+	return NULL;
+}
+
+static struct peer* findPeer(uint16_t fromPort, const struct sockaddr_in* to) {
+	const uint16_t port = ntohs(to->sin_port);
+	for (int i = 0; i < numPeers; i++) {
+		struct peer* p = &peers[i];
+		if (p->addr == to->sin_addr.s_addr && p->port == port && p->fromPort == fromPort) return p;
+	}
+	if (numPeers == MAX_PEERS) return NULL;
+	struct peer* p = &peers[numPeers++];
+	memset(p, 0, sizeof(*p));
+	p->addr = to->sin_addr.s_addr;
+	p->port = port;
+	p->fromPort = fromPort;
+	return p;
+}
+
+/**
+ * Give up on the inbox of p for a while; the datagram goes over UDP.
+ */
+static void detach(struct peer* p) {
+	p->box = NULL;
+	p->slot = NULL;
+	p->retryAt = now() + PEER_RETRY_S;
+}
+
+/**
+ * Drop the mapping of an inbox whose receiver exited and unlinked it; the
+ * port gets a new one if it comes back.
+ */
+static void forgetInbox(struct shmInbox* box) {
+	for (int i = 0; i < numPeers; i++) {
+		if (peers[i].box == box) detach(&peers[i]);
+	}
+	for (int i = 0; i < numMapped; i++) {
+		if (mapped[i].box == box) mapped[i] = mapped[--numMapped];
+	}
+	munmap(box, sizeof(struct shmInbox));
+}
+
+static struct shmInbox* inboxOf(uint16_t port) {
+	for (int i = 0; i < numMapped; i++) {
+		if (mapped[i].port != port) continue;
+		if (__atomic_load_n(&mapped[i].box->pid, __ATOMIC_ACQUIRE)) return mapped[i].box;
+		forgetInbox(mapped[i].box);
+		break;
+	}
+	if (numMapped == MAX_PEERS) return NULL;
+	struct shmInbox* box = mapInbox(port, 0);
+	if (box) {
+		mapped[numMapped].port = port;
+		mapped[numMapped++].box = box;
+	}
+	return box;
+}
+
+static int attach(struct peer* p) {
+	if (now() < p->retryAt) return 0;
+	struct shmInbox* box = inboxOf(p->port);
+	if (!box || !alive(__atomic_load_n(&box->pid, __ATOMIC_ACQUIRE))) {
+		detach(p);
+		return 0;
+	}
+	p->box = box;
+	p->slot = claimSlot(box, p->fromPort);
+	if (!p->slot) detach(p);
+	return p->slot != NULL;
+}
+
+int shmSend(int sock, const void* buf, int len, const struct sockaddr_in* to) {
+	if (!enabled || !isLocal(to->sin_addr.s_addr)) return -1;
+	const uint32_t need = recordSpace(len);
+	if (need > SHM_RING_SIZE / 2) return -1;
+
+	uint16_t fromPort = 0;
+	for (int i = 0; i < numInboxes; i++) {
+		if (inboxes[i].sock == sock) fromPort = inboxes[i].port;
+	}
+	if (!fromPort) fromPort = boundPort(sock);
+	struct peer* p = findPeer(fromPort, to);
+	if (!p || (!p->slot && !attach(p))) return -1;
+	if (!__atomic_load_n(&p->box->pid, __ATOMIC_ACQUIRE)) {
+		forgetInbox(p->box);  // the receiver exited
+		return -1;
+	}
+
+	struct shmSlot* s = p->slot;
+	uint64_t tail = s->tail;
+	const uint64_t head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+	const uint32_t pos = tail % SHM_RING_SIZE;
+	const uint32_t skip = SHM_RING_SIZE - pos < need ? SHM_RING_SIZE - pos : 0;
+	if (SHM_RING_SIZE - (tail - head) < skip + need) {
+		// full: either the receiver is behind or it is gone
+		if (!alive(__atomic_load_n(&p->box->pid, __ATOMIC_ACQUIRE))) detach(p);
+		return -1;
+	}
+	if (skip) {
+		((struct shmRecord*) (s->data + pos))->len = SHM_WRAP;
+		tail += skip;
+	}
+	struct shmRecord* rec = (struct shmRecord*) (s->data + tail % SHM_RING_SIZE);
+	rec->len = len;
+	rec->addr = to->sin_addr.s_addr;
+	memcpy(rec + 1, buf, len);
+	__atomic_store_n(&s->tail, tail + need, __ATOMIC_RELEASE);
+	return len;
+}
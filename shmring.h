@@ -0,0 +1,47 @@
+#ifndef SHMRING_H
+#define SHMRING_H 1
+#include <netinet/in.h>
+#include <stdint.h>
+
+// Shared-memory datagrams between processes on the same host. Every port a
+// process receives on gets an inbox, a POSIX shared memory object named
+// after the port, holding a fixed number of single-producer/single-consumer
+// rings. A sender claims one ring per (its port, destination port) and from
+// then on a datagram to that destination is a copy into the ring instead of
+// a trip through the loopback stack.
+//
+// Delivery keeps UDP's promises and no more: a datagram that does not fit,
+// goes to a peer without an inbox, or finds the ring full is left to the
+// caller to send over the socket, and whatever is in an inbox when its
+// receiver restarts is dropped.
+
+#define SHM_SLOTS 32              // senders per inbox
+#define SHM_RING_SIZE (64 * 1024)  // bytes per ring, power of two
+
+/**
+ * Decide whether the shared-memory path is used at all: it is unless
+ * TXIO_SHM=off (or 0) is set in the environment.
+ */
+void shmInit(void);
+
+int shmEnabled(void);
+
+/**
+ * Create or take over the inbox for the port sock is bound to.
+ */
+void shmWatch(int sock);
+
+/**
+ * Non-blocking receive from the inbox of sock. Same contract as txioRecv:
+ * returns the datagram length, or -1 if nothing was pending. from is set to
+ * the address the datagram would have carried over UDP.
+ */
+int shmRecv(int sock, void* buf, int buflen, struct sockaddr_in* from);
+
+/**
+ * Deliver a datagram through the inbox of a local destination. Returns len,
+ * or -1 if it has to go over the socket instead.
+ */
+int shmSend(int sock, const void* buf, int len, const struct sockaddr_in* to);
+
+#endif /* SHMRING_H */
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slab.h"
+
+struct slabBlock {
+	uint32_t cls;
+	uint32_t pad;
+};
+
+// Written into the payload of free blocks. Only meaningful while the
+// process runs; slabRecover rebuilds the lists.
+struct slabLink {
+	uint32_t next;  // payload offset of the next block, 0 ends the list
+};
+
+// A retired block. Its payload may still be read back from the durable
+// log, so nothing is written into it until its group is reclaimed.
+struct slabRetired {
+	uint32_t off;
+	uint32_t group;  // slabSeal group the block belongs to
+};
+
+static struct slabArena* arena;
+static char* space;
+static uint32_t freeList[SLAB_CLASSES];
+static struct slabRetired* retired;  // queue in the order blocks were retired
+static uint32_t retiredCap, retiredHead, retiredCount;
+static uint32_t openGroup = 1;
+static int openCount;  // blocks retired into openGroup
+
+static struct slabBlock* blockOf(uint32_t off) {
+	return (struct slabBlock*) (space + off - sizeof(struct slabBlock));
+}
+
+static struct slabLink* linkOf(uint32_t off) {
+	return (struct slabLink*) (space + off);
+}
+
+static uint32_t blockSize(uint32_t cls) {
+	return SLAB_MIN_BLOCK << cls;
+}
+
+static void pushFree(uint32_t off) {
+	const uint32_t cls = blockOf(off)->cls;
+	linkOf(off)->next = freeList[cls];
+	freeList[cls] = off;
+}
+
+void slabRecover(struct slabArena* hdr, void* base, uint32_t size,
+		const struct slabRef* live, int numLive) {
+	arena = hdr;
+	space = base;
+	if (arena->size != size || arena->top > size) {
+		if (arena->size) printf("Value arena does not match, discarding it\n");
+		arena->size = size;
+		arena->top = 0;
+	}
+	memset(freeList, 0, sizeof(freeList));
+	// every block can be retired at most once at a time
+	free(retired);
+	retiredCap = size / SLAB_MIN_BLOCK;
+	retired = malloc((retiredCap ? retiredCap : 1) * sizeof(*retired));
+	if (!retired) {
+		perror("Allocating retired block queue");
+		exit(-1);
+	}
+	retiredHead = retiredCount = 0;
+
+	uint32_t pos = 0;
+	while (pos < arena->top) {
+		const struct slabBlock* b = (struct slabBlock*) (space + pos);
+		if (b->cls >= SLAB_CLASSES || pos + blockSize(b->cls) > arena->top) {
+			// torn allocation at the end of the arena, nothing can refer to it
+			arena->top = pos;
+			break;
+		}
+		const uint32_t off = pos + sizeof(struct slabBlock);
+		int inUse = 0;
+		for (int i = 0; i < numLive; i++) {
+			if (live[i].off == off) inUse = 1;
+		}
+		if (!inUse) pushFree(off);
+		pos += blockSize(b->cls);
+	}
+}
+
+uint32_t slabAlloc(uint32_t len) {
+	uint32_t cls = 0;
+	while (cls < SLAB_CLASSES && blockSize(cls) - sizeof(struct slabBlock) < len) cls++;
+	if (cls == SLAB_CLASSES) return 0;
+
+	uint32_t off = freeList[cls];
+	if (off) {
+		freeList[cls] = linkOf(off)->next;
+		return off;
+	}
+	if (arena->size - arena->top < blockSize(cls)) return 0;
+	struct slabBlock* b = (struct slabBlock*) (space + arena->top);
+	b->cls = cls;
+	b->pad = 0;
+	arena->top += blockSize(cls);
+	return (char*) (b + 1) - space;
+}
+
+void* slabPtr(uint32_t off) {
+	return space + off;
+}
+
+void slabRetire(uint32_t off) {
+	if (!off || retiredCount == retiredCap) return;
+	struct slabRetired* r = &retired[(retiredHead + retiredCount++) % retiredCap];
+	r->off = off;
+	r->group = openGroup;
+	openCount++;
+}
+
+uint32_t slabSeal() {
+	if (!openCount) return 0;
+	openCount = 0;
+	return openGroup++;
+}
+
+void slabReclaim(uint32_t group) {
+	// groups are sealed in order, so the queue is sorted by group
+	while (retiredCount && retired[retiredHead].group <= group) {
+		pushFree(retired[retiredHead].off);
+		retiredHead = (retiredHead + 1) % retiredCap;
+		retiredCount--;
+	}
+}
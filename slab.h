@@ -0,0 +1,67 @@
+#ifndef SLAB_H
+#define SLAB_H 1
+#include <stdint.h>
+
+// Slab allocator for variable-length values kept inside a mapped log file.
+// Blocks come in power-of-two size classes and are carved off the end of
+// the arena; the only persistent state is the arena header and one header
+// per block, so values are referenced by offset and survive restarts.
+// Free lists are kept in memory and rebuilt by slabRecover from the
+// references that are still live.
+//
+// A block that is given back may still be referenced by the durable copy
+// of the log, so slabRetire only queues it in memory and leaves its bytes
+// alone. slabSeal closes the current group of retired blocks and
+// slabReclaim links a group into the free lists once the flush that
+// dropped its references is on disk.
+
+#define SLAB_MIN_BLOCK 64  // bytes, including the block header
+#define SLAB_CLASSES 10    // largest block is SLAB_MIN_BLOCK << 9 = 32 KiB
+#define SLAB_BLOCK_HEADER 8  // bytes in front of every payload
+
+struct slabArena {
+	uint32_t size;  // bytes of block space, 0 if not formatted yet
+	uint32_t top;   // bytes of block space handed out so far
+};
+
+// Reference to a value in the arena. off is the offset of the payload, so
+// 0 never names a block and means no value.
+struct slabRef {
+	uint32_t off;
+	uint32_t len;
+};
+
+/**
+ * Attach to the arena described by hdr whose blocks live in the size bytes
+ * at space, formatting it if it is new. Every block that is not one of the
+ * numLive references in live becomes free.
+ */
+void slabRecover(struct slabArena* hdr, void* space, uint32_t size,
+	const struct slabRef* live, int numLive);
+
+/**
+ * Allocate room for len bytes. Returns the payload offset, or 0 if len is
+ * too large or the arena is full.
+ */
+uint32_t slabAlloc(uint32_t len);
+
+void* slabPtr(uint32_t off);
+
+/**
+ * Give back the block at off. It is reused only after slabReclaim of the
+ * group it ends up in.
+ */
+void slabRetire(uint32_t off);
+
+/**
+ * Close the group of blocks retired since the previous call. Returns its
+ * number for slabReclaim, or 0 if nothing was retired.
+ */
+uint32_t slabSeal(void);
+
+/**
+ * Make every block of groups up to and including group reusable.
+ */
+void slabReclaim(uint32_t group);
+
+#endif /* SLAB_H */
@@ -1,11 +1,14 @@
-#define _POSIX_C_SOURCE 1
+#define _POSIX_C_SOURCE 200809L
 
 #ifdef __APPLE__
 #define _DARWIN_C_SOURCE 1
 #endif
 
 #include "tmanager.h"
+#include "capture.h"
 #include "msg.h"
+#include "trace.h"
+#include "txio.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -50,6 +53,17 @@ void initServer() {
 
 void initLogFile() {
   snprintf(logFileName, sizeof(logFileName), "TXMG_%lu.log", port);
+
+  char traceFileName[128];
+  snprintf(traceFileName, sizeof(traceFileName), "TXMG_%lu.trace", port);
+  traceInit(TRACE_MANAGER, port, traceFileName);
+
+  char captureFileName[128];
+  snprintf(captureFileName, sizeof(captureFileName), "TXMG_%lu.capture", port);
+  captureInit(port, captureFileName);
+  printf("Capture:                  %s\n",
+         captureEnabled() ? captureFileName : "off");
+
   logfileFD = open(logFileName, O_RDWR | O_CREAT | O_SYNC, S_IRUSR | S_IWUSR);
 
   if (logfileFD < 0) {
@@ -68,7 +82,7 @@ void initLogFile() {
   if (fstatus.st_size < sizeof(struct transactionSet)) {
     printf("Initializing the log file size\n");
     struct transactionSet tx;
-    bzero(&tx, sizeof(tx));
+    memset(&tx, 0, sizeof(tx));
     for (int i = 0; i < MAX_TX; i++) {
       tx.transaction[i].timer = -1;
     }
@@ -80,27 +94,43 @@ void initLogFile() {
 }
 
 void logToFile() {
-  if (msync(txlog, sizeof(struct transactionSet), MS_SYNC | MS_INVALIDATE)) {
-    perror("Msync problem");
+  for (int i = 0; i < MAX_TX; i++) {
+    txlog->transaction[i].checksum = slotChecksum(&txlog->transaction[i]);
   }
+  txioFlush();
 }
 
-void initTransactionLog() {
-  txlog = mmap(NULL, 512, PROT_READ | PROT_WRITE, MAP_SHARED, logfileFD, 0);
+/*
+ * Map the log in. Returns 1 if it already held transactions from an earlier
+ * run that must be recovered.
+ */
+int initTransactionLog() {
+  txlog = mmap(NULL, sizeof(struct transactionSet), PROT_READ | PROT_WRITE,
+               MAP_SHARED, logfileFD, 0);
 
-  if (txlog == NULL) {
+  if (txlog == MAP_FAILED) {
     perror("Log file could not be mapped in:");
     exit(-1);
   }
 
+  txioInit(logfileFD, txlog, sizeof(struct transactionSet));
+  txioWatch(sockfd);
+  printf("I/O backend:              %s\n", txioBackendName());
+  printf("Log syncs:                %s\n", txioLogModeName());
+  printf("Durability:               %s\n", txioDurabilityName());
+  printf("Local peers:              %s\n", txioLocalName());
+
   if (!txlog->initialized) {
-    for (int i = 0; i < MAX_WORKERS; i++) {
+    for (int i = 0; i < MAX_TX; i++) {
       txlog->transaction[i].tstate = TX_NOTINUSE;
     }
 
-    logToFile();
+    txlog->nextTid = LEASED_TID_BASE;
     txlog->initialized = 1;
+    logToFile();
+    return 0;
   }
+  return 1;
 }
 
 void processArgs(int argc, char **argv) {
@@ -117,27 +147,62 @@ void processArgs(int argc, char **argv) {
     printf("Port conversion error\n");
     exit(-1);
   }
+
+  const char *fanout = getenv("TXFANOUT");
+  if (fanout) {
+    commitFanout = atoi(fanout);
+  }
+  if (commitFanout > MAX_FANOUT) {
+    commitFanout = MAX_FANOUT;
+  }
+  if (commitFanout > 0) {
+    printf("Commit fanout:            %d\n", commitFanout);
+  } else {
+    commitFanout = 0;
+    printf("Commit fanout:            flat\n");
+  }
+
+  suspectMs = SUSPECT_MS;
+  const char *suspect = getenv("TXSUSPECT");
+  if (suspect) {
+    suspectMs = atoi(suspect);
+  }
+  if (suspectMs > 0) {
+    printf("Failure detection:        after %d ms\n", suspectMs);
+  } else {
+    suspectMs = 0;
+    printf("Failure detection:        off\n");
+  }
+
+  // TXWEIGHTS=finish,join,begin
+  queues[CLASS_FINISH].weight = 0;
+  queues[CLASS_JOIN].weight = 8;
+  queues[CLASS_BEGIN].weight = 2;
+  const char *weights = getenv("TXWEIGHTS");
+  if (weights) {
+    sscanf(weights, "%d,%d,%d", &queues[CLASS_FINISH].weight,
+           &queues[CLASS_JOIN].weight, &queues[CLASS_BEGIN].weight);
+  }
+  printf("Message weights:          finish %d, join %d, begin %d (0: all)\n",
+         queues[CLASS_FINISH].weight, queues[CLASS_JOIN].weight,
+         queues[CLASS_BEGIN].weight);
 }
 
 int receiveMessage(managerType *message, struct sockaddr_in *client) {
-  socklen_t len = sizeof(struct sockaddr_in);
-  int n = recvfrom(sockfd, message, sizeof(managerType), MSG_DONTWAIT,
-                   (struct sockaddr *)client, &len);
+  int n = txioRecv(sockfd, message, sizeof(managerType), client);
 
   if (n == sizeof(managerType)) {
     return n;
   }
   if (n != -1) {
     printf("Received packet with invalid size: %d\n", n);
-  } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-    perror("Receive packet error");
   }
-  return n;
+  return -1;
 }
 
 int sendMessage(managerType *message, struct sockaddr_in *client) {
-  int n = sendto(sockfd, message, sizeof(managerType), 0,
-                 (struct sockaddr *)client, sizeof(struct sockaddr_in));
+  TRACE(TRACE_MESSAGES, TR_MSG_OUT, message->tid, 0, message->type);
+  int n = txioSend(sockfd, message, sizeof(managerType), client);
   if (n < 0) {
     perror("Sending error");
     exit(-1);
@@ -146,10 +211,26 @@ int sendMessage(managerType *message, struct sockaddr_in *client) {
   return n;
 }
 
+/*
+ * Reply with a message that reports logged state; it is released once the
+ * log is on disk.
+ */
+void sendDurableMessage(managerType *message, struct sockaddr_in *client) {
+  TRACE(TRACE_MESSAGES, TR_MSG_OUT, message->tid, 0, message->type);
+  txioSendDurable(sockfd, message, sizeof(managerType), client);
+}
+
+long long nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 int getTransactionById(unsigned long txId) {
   for (int i = 0; i < sizeof txlog->transaction / sizeof txlog->transaction[0];
        i++) {
-    if (txlog->transaction[i].txID == txId) {
+    if (txlog->transaction[i].tstate != TX_NOTINUSE &&
+        txlog->transaction[i].txID == txId) {
       return i;
     }
   }
@@ -164,6 +245,8 @@ void setTransactionState(unsigned long txId, enum txState state) {
       txlog->transaction[i].tstate = state;
     }
   }
+  logToFile();
+  TRACE(TRACE_STATE, TR_STATE, txId, state, 0);
 }
 
 void setTransactionTimer(unsigned long txId, time_t timer) {
@@ -179,7 +262,8 @@ int isTransactionInUse(unsigned long tid) {
   int isDuplicate = 0;
   for (int i = 0;
        i < sizeof(txlog->transaction) / sizeof(txlog->transaction[0]); i++) {
-    if (tid == txlog->transaction[i].txID) {
+    if (txlog->transaction[i].tstate != TX_NOTINUSE &&
+        tid == txlog->transaction[i].txID) {
       isDuplicate = 1;
     }
   }
@@ -188,190 +272,741 @@ int isTransactionInUse(unsigned long tid) {
 
 int getNumWorkers(int i) { return txlog->transaction[i].numWorkers; }
 
-worker *getWorkers(unsigned long tid) {
-  for (int i = 0;
-       i < sizeof(txlog->transaction) / sizeof(txlog->transaction[0]); i++) {
-    if (tid == txlog->transaction[i].txID) {
-      return txlog->transaction[i].workers;
+int sameClient(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+         a->sin_port == b->sin_port;
+}
+
+unsigned clientBucket(const struct sockaddr_in *client) {
+  uint32_t h = client->sin_addr.s_addr * 2654435761u ^
+               (uint32_t)client->sin_port * 40503u;
+  return (h ^ h >> 15) & (DIRECTORY_BUCKETS - 1);
+}
+
+/*
+ * Address of participant w of slot i.
+ */
+struct sockaddr_in *workerAddr(int i, int w) {
+  return &txlog->directory[txlog->transaction[i].workers[w]].client;
+}
+
+/*
+ * Directory id of client, or -1 if it never registered.
+ */
+int findRegistered(const struct sockaddr_in *client) {
+  uint16_t *entry = registered.entry;
+  for (unsigned b = clientBucket(client); entry[b];
+       b = (b + 1) & (DIRECTORY_BUCKETS - 1)) {
+    if (sameClient(&txlog->directory[entry[b] - 1].client, client)) {
+      return entry[b] - 1;
     }
   }
-  return NULL;
+  return -1;
 }
 
-int getNumAnswers(unsigned long tid) {
-  int numAnswers = 0;
-  for (int i = 0; i < MAX_TX; i++) {
-    if (txlog->transaction[i].txID == tid) {
-      numAnswers = txlog->transaction[i].numAnswers;
-    }
+void indexRegistered(int id) {
+  uint16_t *entry = registered.entry;
+  unsigned b = clientBucket(&txlog->directory[id].client);
+  while (entry[b]) {
+    b = (b + 1) & (DIRECTORY_BUCKETS - 1);
   }
+  entry[b] = id + 1;
+}
 
-  return numAnswers;
+/*
+ * Rebuild the directory index from the log.
+ */
+void indexDirectory() {
+  memset(&registered, 0, sizeof(registered));
+  for (int id = 0; id < txlog->numRegistered; id++) {
+    indexRegistered(id);
+  }
 }
 
-int getNumYesVotes(unsigned long tid, int numWorkers) {
-  int numVotes = 0;
+/*
+ * An id no slot in use refers to, for when the directory is full. Workers
+ * come and go on new ports, so old entries are handed out again. There
+ * always is one: the directory has room for every slot to be full.
+ */
+int reclaimId() {
+  static uint64_t inUse[MAX_DIRECTORY / 64];
+  memset(inUse, 0, sizeof(inUse));
   for (int i = 0; i < MAX_TX; i++) {
-    if (txlog->transaction[i].txID == tid) {
-      numVotes = txlog->transaction[i].numYesVotes;
+    transaction *tx = &txlog->transaction[i];
+    if (tx->tstate == TX_NOTINUSE) {
+      continue;
+    }
+    for (int w = 0; w < tx->numWorkers; w++) {
+      inUse[tx->workers[w] / 64] |= (uint64_t)1 << (tx->workers[w] % 64);
     }
   }
+  for (int id = 0; id < MAX_DIRECTORY; id++) {
+    if (!(inUse[id / 64] >> (id % 64) & 1)) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Directory id of client, registering it if it is new. The entry reaches
+ * the disk with the flush that logs the slot using it.
+ */
+int registerWorker(const struct sockaddr_in *client) {
+  int id = findRegistered(client);
+  if (id >= 0) {
+    return id;
+  }
+  int reused = txlog->numRegistered == MAX_DIRECTORY;
+  id = reused ? reclaimId() : txlog->numRegistered++;
+  if (id < 0) {
+    return -1;
+  }
+  txlog->directory[id].client = *client;
+  txlog->directory[id].checksum = workerChecksum(&txlog->directory[id]);
+  if (reused) {
+    indexDirectory();
+  } else {
+    indexRegistered(id);
+  }
+  return id;
+}
 
-  return numVotes == numWorkers;
+/*
+ * Position of client among the participants of slot i, or -1.
+ */
+int findWorker(int i, const struct sockaddr_in *client) {
+  int id = findRegistered(client);
+  return id < 0 ? -1 : participants[i].position[id] - 1;
 }
 
-void setWorkerVote(unsigned long tid) {
-  for (int i = 0; i < MAX_TX; i++) {
-    txlog->transaction[i].numAnswers++;
-    if (txlog->transaction[i].txID == tid) {
-      txlog->transaction[i].numYesVotes++;
-    }
+/*
+ * Rebuild the index of slot i from its logged participants.
+ */
+void indexWorkers(int i) {
+  memset(&participants[i], 0, sizeof(participants[i]));
+  for (int w = 0; w < txlog->transaction[i].numWorkers; w++) {
+    participants[i].position[txlog->transaction[i].workers[w]] = w + 1;
   }
 }
 
-void resetTimer(int i) {
-  txlog->transaction[i].timer = -1;
-  txlog->transaction[i].numAnswers = 0;
-  txlog->transaction[i].numYesVotes = 0;
+/*
+ * Register client as a participant of slot i. Returns its position, which
+ * is the one it already had if it joined before, or -1 if the transaction
+ * is full.
+ */
+int addWorker(int i, const struct sockaddr_in *client) {
+  transaction *tx = &txlog->transaction[i];
+  int w = findWorker(i, client);
+  if (w >= 0) {
+    return w;
+  }
+  int id;
+  if (tx->numWorkers == MAX_WORKERS || (id = registerWorker(client)) < 0) {
+    return -1;
+  }
+  w = tx->numWorkers++;
+  tx->workers[w] = id;
+  participants[i].position[id] = w + 1;
+  lastHeard[i][w] = nowMs();
+  return w;
+}
+
+int testBit(const uint64_t *bits, int w) { return bits[w / 64] >> (w % 64) & 1; }
+
+/*
+ * Set bit w. Returns 0 if it already was.
+ */
+int setBit(uint64_t *bits, int w) {
+  uint64_t mask = (uint64_t)1 << (w % 64);
+  if (bits[w / 64] & mask) {
+    return 0;
+  }
+  bits[w / 64] |= mask;
+  return 1;
+}
+
+/*
+ * First participant from w on whose bit is clear, or n if there is none.
+ */
+int nextClear(const uint64_t *bits, int w, int n) {
+  while (w < n) {
+    uint64_t clear = ~bits[w / 64] >> (w % 64);
+    if (clear) {
+      w += __builtin_ctzll(clear);
+      break;
+    }
+    w = (w / 64 + 1) * 64;
+  }
+  return w < n ? w : n;
 }
 
+void resetTimer(int i) { txlog->transaction[i].timer = -1; }
+
+/*
+ * Send the outcome to every worker that has not acknowledged it yet.
+ */
 void sendResult(int i, uint32_t state) {
-  worker *workers = getWorkers(txlog->transaction[i].txID);
-  int numWorkers = getNumWorkers(i);
-  managerType message;
+  transaction *tx = &txlog->transaction[i];
+  managerType message = {tx->txID, state};
 
-  message.tid = txlog->transaction[i].txID;
-  message.type = state;
+  for (int j = nextClear(tx->acked, 0, tx->numWorkers); j < tx->numWorkers;
+       j = nextClear(tx->acked, j + 1, tx->numWorkers)) {
+    sendDurableMessage(&message, workerAddr(i, j));
+  }
+  resetTimer(i);
+}
 
-  for (int j = 0; j < numWorkers; j++) {
-    sendMessage(&message, &workers[j].client);
+/*
+ * Send the outcome to the manager's children in the commit tree only; every
+ * worker forwards it to its own children.
+ */
+void announceResult(int i, uint32_t state) {
+  transaction *tx = &txlog->transaction[i];
+  managerType message = {tx->txID, state};
+  for (int j = 0; j < tx->fanout; j++) {
+    int child = TREE_CHILD(tx->fanout, -1, j);
+    if (child < tx->numWorkers) {
+      sendDurableMessage(&message, workerAddr(i, child));
+    }
   }
   resetTimer(i);
 }
 
+/*
+ * Hand slot i back. Nothing about the transaction is remembered afterwards,
+ * so a worker that polls for it is told it aborted.
+ */
+void releaseSlot(int i) {
+  if (slotStart[i]) {
+    long long held = nowMs() - slotStart[i];
+    avgHoldMs = avgHoldMs ? (7 * avgHoldMs + held) / 8 : held;
+    slotStart[i] = 0;
+  }
+  for (int w = 0; w < txlog->transaction[i].numWorkers; w++) {
+    participants[i].position[txlog->transaction[i].workers[w]] = 0;
+  }
+  memset(&txlog->transaction[i], 0, sizeof(txlog->transaction[i]));
+  txlog->transaction[i].tstate = TX_NOTINUSE;
+  txlog->transaction[i].timer = -1;
+  logToFile();
+}
+
+/*
+ * Log and send the outcome of slot i. An aborted slot is free right away;
+ * a committed one is kept, and the outcome resent every TIMEOUT seconds,
+ * until every worker has acknowledged it.
+ */
+void decideTransaction(int i, enum txState state) {
+  if (state == TX_COMMITTED) {
+    if (txlog->transaction[i].tstate == TX_COMMITTED) {
+      // a resend, after a timeout or a restart: the commit is logged
+      // already, and a worker whose parent forwarded it before the copy
+      // got lost must hear from the manager itself
+      sendResult(i, TXMSG_COMMITTED);
+    } else {
+      setTransactionState(txlog->transaction[i].txID, state);
+      if (txlog->transaction[i].fanout) {
+        // passed down the tree
+        announceResult(i, TXMSG_COMMITTED);
+      } else {
+        sendResult(i, TXMSG_COMMITTED);
+      }
+    }
+    txlog->transaction[i].timer = time(NULL) + TIMEOUT;
+  } else {
+    setTransactionState(txlog->transaction[i].txID, state);
+    sendResult(i, TXMSG_ABORTED);
+    releaseSlot(i);
+  }
+}
+
+/*
+ * Count a yes vote; a vote from a sub-coordinator covers its whole subtree.
+ * Each participant's vote is counted once however often it is resent, and
+ * votes from anyone else, or after the decision, are ignored.
+ */
 void processCommitVote(managerType *message, struct sockaddr_in *client) {
-  setWorkerVote(message->tid);
+  int index = getTransactionById(message->tid);
+  if (index < 0 || txlog->transaction[index].tstate != TX_VOTING) {
+    return;
+  }
+  transaction *tx = &txlog->transaction[index];
+  int w = findWorker(index, client);
+  if (w < 0 || !setBit(tx->voted, w)) {
+    TRACE(TRACE_MESSAGES, TR_IGNORED, message->tid, tx->tstate,
+          message->type);
+    return;
+  }
+  tx->numAnswers += message->arg ? message->arg : 1;
+
+  if (tx->numAnswers >= tx->numWorkers) {
+    if (tx->pendingCrash == 1) {
+      tx->pendingCrash = 0;
+      perror("Commit crash");
+      txioDrain();
+      TRACE(TRACE_STATE, TR_CRASH, message->tid, TX_VOTING, 0);
+      exit(-1);
+    }
+    // All nodes voted yes
+    decideTransaction(index, TX_COMMITTED);
+  }
+}
 
+/*
+ * One no vote is enough to abort; there is no need to wait for the others.
+ */
+void processAbortVote(managerType *message, struct sockaddr_in *client) {
   int index = getTransactionById(message->tid);
-  int numWorkers = getNumWorkers(index);
-  int numYesVotes = getNumYesVotes(message->tid, numWorkers);
-  int numAnswers = getNumAnswers(message->tid);
+  if (index < 0 || txlog->transaction[index].tstate != TX_VOTING ||
+      findWorker(index, client) < 0) {
+    return;
+  }
+  decideTransaction(index, TX_ABORTED);
+}
 
-  if (numAnswers == numWorkers) {
-    for (int i = 0; i < MAX_TX; i++) {
-      if (txlog->transaction[i].txID == message->tid) {
-        if (txlog->transaction[i].pendingCrash == 1) {
-	  txlog->transaction[i].pendingCrash = 0;
-          perror("Commit crash");
-          exit(-1);
-        } else {
-          if (numYesVotes == numWorkers) {
-            // All nodes voted yes.
-            setTransactionState(message->tid, TX_COMMITTED);
-            message->type = TXMSG_COMMITTED;
-            for (int i = 0; i < numWorkers; i++) {
-              sendResult(i, TXMSG_COMMITTED);
-            }
-          } else {
-            setTransactionState(message->tid, TX_ABORTED);
-            message->type = TXMSG_ABORTED;
-            for (int i = 0; i < numWorkers; i++) {
-              sendResult(i, TXMSG_ABORTED);
-            }
-          }
-        }
-        resetTimer(i);
-      }
+/*
+ * Send PREPARE with the list of participants. In a tree commit it goes to
+ * the manager's children only and they pass it on, each answering with one
+ * vote for its subtree; otherwise every worker gets it.
+ */
+void sendPrepare(int index) {
+  transaction *tx = &txlog->transaction[index];
+  static prepareType prepare;
+  memset(&prepare, 0, sizeof(prepare));
+  prepare.hdr.tid = tx->txID;
+  prepare.hdr.type = TXMSG_PREPARE_TO_COMMIT;
+  prepare.fanout = tx->fanout;
+  prepare.count = tx->numWorkers;
+  for (int i = 0; i < tx->numWorkers; i++) {
+    prepare.participants[i].addr = workerAddr(index, i)->sin_addr.s_addr;
+    prepare.participants[i].port = workerAddr(index, i)->sin_port;
+  }
+  int recipients = tx->fanout ? tx->fanout : tx->numWorkers;
+  for (int j = 0; j < recipients; j++) {
+    int child = tx->fanout ? TREE_CHILD(tx->fanout, -1, j) : j;
+    if (child >= tx->numWorkers) {
+      break;
     }
+    prepare.hdr.arg = child;
+    TRACE(TRACE_MESSAGES, TR_MSG_OUT, tx->txID, 0, TXMSG_PREPARE_TO_COMMIT);
+    txioSendDurable(sockfd, &prepare, PREPARE_SIZE(prepare.count),
+                    workerAddr(index, child));
   }
 }
 
+/*
+ * Answer a commit or abort request that comes too late to change anything:
+ * a decided slot reports its outcome, a vote in progress just goes on.
+ */
+void answerFromState(int index, managerType *message,
+                     struct sockaddr_in *client) {
+  transaction *tx = &txlog->transaction[index];
+  TRACE(TRACE_MESSAGES, TR_IGNORED, message->tid, tx->tstate, message->type);
+  if (tx->tstate == TX_COMMITTED || tx->tstate == TX_ABORTED) {
+    managerType outcome = {message->tid, tx->tstate == TX_COMMITTED
+                                             ? TXMSG_COMMITTED
+                                             : TXMSG_ABORTED};
+    sendMessage(&outcome, client);
+  }
+}
+
+/*
+ * Whether an abort request may still decide slot index.
+ */
+int isAbortable(int index) {
+  return txlog->transaction[index].tstate == TX_INPROGRESS ||
+         txlog->transaction[index].tstate == TX_VOTING;
+}
+
 void processCommit(managerType *message, struct sockaddr_in *client) {
-  worker *workers = getWorkers(message->tid);
-  setTransactionTimer(message->tid, time(NULL) + TIMEOUT);
-  for (int i = 0; i < sizeof *workers / sizeof workers[0]; i++) {
-    if (workers[i].initialized == 1) {
-      message->type = TXMSG_PREPARE_TO_COMMIT;
-      sendMessage(message, &workers->client);
-      setTransactionState(message->tid, TX_VOTING);
+  int index = getTransactionById(message->tid);
+  if (index < 0) {
+    return;
+  }
+  transaction *tx = &txlog->transaction[index];
+  if (tx->tstate != TX_INPROGRESS) {
+    if (tx->tstate == TX_VOTING && message->arg && !tx->fanout) {
+      // another worker asked first; this one still votes yes with its request
+      managerType vote = {message->tid, TXMSG_VOTE_COMMIT, 1};
+      processCommitVote(&vote, client);
+      return;
     }
+    answerFromState(index, message, client);
+    return;
+  }
+  tx->fanout = commitFanout && tx->numWorkers > commitFanout ? commitFanout : 0;
+  setTransactionTimer(message->tid, time(NULL) + TIMEOUT);
+  setTransactionState(message->tid, TX_VOTING);
+  sendPrepare(index);
+  if (message->arg && !tx->fanout) {
+    // the requester prepared before asking; in a tree its vote comes with
+    // its subtree's instead
+    managerType vote = {message->tid, TXMSG_VOTE_COMMIT, 1};
+    processCommitVote(&vote, client);
   }
 }
 
 void processCommitCrash(managerType *message, struct sockaddr_in *client) {
+  int index = getTransactionById(message->tid);
+  if (index < 0) {
+    return;
+  }
+  int started = txlog->transaction[index].tstate == TX_INPROGRESS;
   processCommit(message, client);
-  for (int i = 0; i < MAX_TX; i++) {
-    if (txlog->transaction[i].txID == message->tid) {
-      txlog->transaction[i].pendingCrash = 1;
-    }
+  if (started && txlog->transaction[index].tstate == TX_VOTING) {
+    txlog->transaction[index].pendingCrash = 1;
   }
 }
 
 void processAbort(managerType *message, struct sockaddr_in *client) {
-  worker *workers = getWorkers(message->tid);
-  for (int i = 0; i < sizeof(*workers) / sizeof(workers[0]); i++) {
-    if (workers[i].initialized == 1) {
-      message->type = TXMSG_ABORTED;
-      sendMessage(message, &workers[i].client);
-      setTransactionState(message->tid, TX_ABORTED);
-      resetTimer(i);
-    }
+  int index = getTransactionById(message->tid);
+  if (index < 0) {
+    return;
   }
+  if (!isAbortable(index)) {
+    answerFromState(index, message, client);
+    return;
+  }
+  decideTransaction(index, TX_ABORTED);
 }
 
 void processAbortCrash(managerType *message, struct sockaddr_in *client) {
+  int index = getTransactionById(message->tid);
+  if (index < 0) {
+    return;
+  }
+  if (!isAbortable(index)) {
+    answerFromState(index, message, client);
+    return;
+  }
   setTransactionState(message->tid, TX_ABORTED);
-  txlog->initialized = 0;
+  txioDrain();
+  TRACE(TRACE_STATE, TR_CRASH, message->tid, TX_ABORTED, 0);
   exit(-1);
 }
 
-void processBegin(managerType *message, struct sockaddr_in *client) {
-  if (isTransactionInUse(message->tid)) {
+int getFreeSlot() {
+  for (int i = 0; i < MAX_TX; ++i) {
+    if (txlog->transaction[i].tstate == TX_NOTINUSE) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void admitBegin(int i, unsigned long tid, struct sockaddr_in *client) {
+  txlog->transaction[i].txID = tid;
+  txlog->transaction[i].timer = -1;
+  addWorker(i, client);
+  slotStart[i] = nowMs();
+  lastAdmittedHost = client->sin_addr;
+  setTransactionState(tid, TX_INPROGRESS);
+  managerType message = {tid, TXMSG_TID_OK};
+  sendDurableMessage(&message, client);
+}
+
+/*
+ * Suggested wait before a refused BEGIN is retried: long enough for the
+ * BEGINs already queued to get a slot, judging by how long slots are held.
+ */
+uint32_t retryAfterMs() {
+  long long hint = avgHoldMs * (numPending + 1) / MAX_TX;
+  return hint < MIN_RETRY_MS ? MIN_RETRY_MS : hint;
+}
+
+void sendBusy(unsigned long tid, struct sockaddr_in *client) {
+  managerType message = {tid, TXMSG_BUSY, retryAfterMs()};
+  sendMessage(&message, client);
+}
+
+/*
+ * Queue a BEGIN until a slot frees up. Returns 0 if the queue, or this
+ * host's share of it, is full.
+ */
+int queueBegin(unsigned long tid, struct sockaddr_in *client) {
+  int fromHost = 0;
+  for (int i = 0; i < numPending; i++) {
+    if (pending[i].txID == tid &&
+        pending[i].client.sin_addr.s_addr == client->sin_addr.s_addr &&
+        pending[i].client.sin_port == client->sin_port) {
+      return 1; // retransmission
+    }
+    if (pending[i].client.sin_addr.s_addr == client->sin_addr.s_addr) {
+      fromHost++;
+    }
+  }
+  if (numPending == MAX_PENDING || fromHost == MAX_PENDING_PER_HOST) {
+    return 0;
+  }
+  pending[numPending].txID = tid;
+  pending[numPending].client = *client;
+  pending[numPending].queuedAt = nowMs();
+  numPending++;
+  return 1;
+}
+
+void removePending(int i) {
+  memmove(&pending[i], &pending[i + 1], (numPending - i - 1) * sizeof(pending[0]));
+  numPending--;
+}
+
+/*
+ * Admit queued BEGINs while there are free slots, oldest first but taking
+ * turns between hosts, and turn away those that waited too long.
+ */
+void servePendingBegins() {
+  if (!numPending) {
+    return;
+  }
+  long long now = nowMs();
+  for (int i = 0; i < numPending;) {
+    if (now - pending[i].queuedAt > PENDING_WAIT_MS) {
+      sendBusy(pending[i].txID, &pending[i].client);
+      removePending(i);
+    } else {
+      i++;
+    }
+  }
+  int slot;
+  while (numPending && (slot = getFreeSlot()) >= 0) {
+    int next = 0;
+    for (int i = 0; i < numPending; i++) {
+      if (pending[i].client.sin_addr.s_addr != lastAdmittedHost.s_addr) {
+        next = i;
+        break;
+      }
+    }
+    pendingBegin p = pending[next];
+    removePending(next);
+    if (isTransactionInUse(p.txID)) {
+      managerType message = {p.txID, TXMSG_TID_BAD};
+      sendMessage(&message, &p.client);
+    } else {
+      admitBegin(slot, p.txID, &p.client);
+    }
+  }
+}
+
+/*
+ * Hand the worker a block of tids of its own. Leased tids are unique, so
+ * BEGINs with them never collide.
+ */
+void processLease(managerType *message, struct sockaddr_in *client) {
+  uint32_t count = message->arg && message->arg < MAX_LEASE ? message->arg
+                                                            : MAX_LEASE;
+  if (txlog->nextTid > UINT32_MAX - count) {
     message->type = TXMSG_TID_BAD;
     sendMessage(message, client);
-  } else {
+    return;
+  }
+  managerType grant = {txlog->nextTid, TXMSG_LEASE_GRANT, count};
+  txlog->nextTid += count;
+  logToFile();
+  sendDurableMessage(&grant, client);
+}
+
+/*
+ * Whether a BEGIN with a leased tid starts a new transaction. Nobody else
+ * can hold that tid, so if it is in use the BEGIN is a retransmission and
+ * is answered again.
+ */
+int isNewLeasedBegin(managerType *message, struct sockaddr_in *client) {
+  if (message->tid >= txlog->nextTid) {
+    // never handed out
+    message->type = TXMSG_TID_BAD;
+    sendMessage(message, client);
+    return 0;
+  }
+  if (!isTransactionInUse(message->tid)) {
+    return 1;
+  }
+  int index = getTransactionById(message->tid);
+  if (txlog->transaction[index].tstate == TX_INPROGRESS &&
+      findWorker(index, client) == 0) {
     message->type = TXMSG_TID_OK;
     sendMessage(message, client);
-    for (int i = 0; i < MAX_TX; ++i) {
-      if (txlog->transaction[i].tstate == TX_NOTINUSE) {
-        txlog->transaction[i].txID = message->tid;
-        worker *w =
-            &txlog->transaction[i].workers[txlog->transaction[i].numWorkers++];
-        w->client = *client;
-        w->initialized = 1;
-        break;
-      }
+  }
+  return 0;
+}
+
+void processBegin(managerType *message, struct sockaddr_in *client) {
+  if (message->tid >= LEASED_TID_BASE) {
+    if (!isNewLeasedBegin(message, client)) {
+      return;
     }
-    setTransactionState(message->tid, TX_INPROGRESS);
+  } else if (isTransactionInUse(message->tid)) {
+    message->type = TXMSG_TID_BAD;
+    sendMessage(message, client);
+    return;
+  }
+  int slot = getFreeSlot();
+  if (slot >= 0 && !numPending) {
+    admitBegin(slot, message->tid, client);
+  } else if (!queueBegin(message->tid, client)) {
+    sendBusy(message->tid, client);
+  }
+}
+
+/*
+ * A worker asks for the outcome, typically after a restart. Unknown
+ * transactions were either aborted or never decided, so they are reported
+ * as aborted; undecided ones get their answer when the vote ends.
+ */
+void processPoll(managerType *message, struct sockaddr_in *client) {
+  int index = getTransactionById(message->tid);
+  if (index < 0) {
+    message->type = TXMSG_ABORTED;
+    sendMessage(message, client);
+  } else if (txlog->transaction[index].tstate == TX_COMMITTED) {
+    message->type = TXMSG_COMMITTED;
+    sendMessage(message, client);
+  }
+}
+
+/*
+ * A worker applied the commit; forget the transaction once all have.
+ */
+void processDone(managerType *message, struct sockaddr_in *client) {
+  int index = getTransactionById(message->tid);
+  if (index < 0 || txlog->transaction[index].tstate != TX_COMMITTED) {
+    return;
+  }
+  transaction *tx = &txlog->transaction[index];
+  int w = findWorker(index, client);
+  if (w >= 0 && setBit(tx->acked, w)) {
+    tx->numAcks++;
+  }
+  if (tx->numAcks == tx->numWorkers) {
+    releaseSlot(index);
   }
 }
 
+/*
+ * Register a participant. A JOIN from one already registered is a
+ * retransmission and gets the same answer; once PREPARE is out the set of
+ * participants is fixed.
+ */
 void processJoin(managerType *message, struct sockaddr_in *client) {
-  if (!isTransactionInUse(message->tid)) {
+  int index = getTransactionById(message->tid);
+  if (index < 0 || txlog->transaction[index].tstate != TX_INPROGRESS ||
+      addWorker(index, client) < 0) {
     message->type = TXMSG_TID_BAD;
     sendMessage(message, client);
-  } else {
-    message->type = TXMSG_TID_OK;
+    return;
+  }
+  logToFile();
+  message->type = TXMSG_TID_OK;
+  sendDurableMessage(message, client);
+}
+
+/*
+ * A worker in an undecided transaction is alive. One still asking about a
+ * transaction that was decided missed the outcome and is told again.
+ */
+void processHeartbeat(managerType *message, struct sockaddr_in *client) {
+  if (!isTransactionInUse(message->tid)) {
+    message->type = TXMSG_ABORTED;
     sendMessage(message, client);
-    for (int i = 0; i < MAX_TX; ++i) {
-      if (txlog->transaction[i].txID == message->tid) {
-        worker *w =
-            &txlog->transaction[i].workers[txlog->transaction[i].numWorkers++];
-        w->client = *client;
-        w->initialized = 1;
-        break;
-      }
+    return;
+  }
+  int index = getTransactionById(message->tid);
+  transaction *tx = &txlog->transaction[index];
+  int w = findWorker(index, client);
+  if (w < 0) {
+    return;
+  }
+  lastHeard[index][w] = nowMs();
+  if (tx->tstate == TX_COMMITTED && !testBit(tx->acked, w)) {
+    message->type = TXMSG_COMMITTED;
+    sendMessage(message, client);
+  }
+}
+
+/*
+ * Whether worker w no longer matters to the vote: it voted, or in a tree
+ * commit an inner node voted for its subtree.
+ */
+int voteCovered(transaction *tx, int w) {
+  for (; w >= 0; w = tx->fanout ? w / tx->fanout - 1 : -1) {
+    if (testBit(tx->voted, w)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Abort slot i as soon as a worker whose vote it still needs has been silent
+ * for suspectMs, instead of waiting for TIMEOUT. Workers send heartbeats
+ * until they learn the outcome.
+ */
+void checkParticipants(int i) {
+  transaction *tx = &txlog->transaction[i];
+  long long now = nowMs();
+  if (!suspectMs || now < nextCheck[i] ||
+      (tx->tstate != TX_INPROGRESS && tx->tstate != TX_VOTING)) {
+    return;
+  }
+  nextCheck[i] = now + suspectMs / 4;
+  for (int w = nextClear(tx->voted, 0, tx->numWorkers); w < tx->numWorkers;
+       w = nextClear(tx->voted, w + 1, tx->numWorkers)) {
+    if (now - lastHeard[i][w] > suspectMs && !voteCovered(tx, w)) {
+      TRACE(TRACE_STATE, TR_SUSPECT, tx->txID, tx->tstate,
+            ntohs(workerAddr(i, w)->sin_port));
+      decideTransaction(i, TX_ABORTED);
+      return;
+    }
+  }
+}
+
+enum messageClass classifyMessage(uint32_t type) {
+  switch (type) {
+  case TXMSG_BEGIN:
+  case TXMSG_LEASE_REQUEST:
+    return CLASS_BEGIN;
+  case TXMSG_JOIN:
+    return CLASS_JOIN;
+  default:
+    return CLASS_FINISH;
+  }
+}
+
+/*
+ * Move everything the socket has for us into the class queues. A message
+ * whose queue is full is dropped; its sender resends it like a lost one.
+ * Heartbeats are handled on the spot, untraced: they are cheap, frequent and
+ * must not take queue space from votes and acks.
+ */
+void receiveMessages() {
+  for (int n = 0; n < NUM_CLASSES * MAX_QUEUED; n++) {
+    queuedMessage m;
+    if (receiveMessage(&m.message, &m.client) < 0) {
+      return;
     }
+    if (m.message.type == TXMSG_HEARTBEAT) {
+      processHeartbeat(&m.message, &m.client);
+      continue;
+    }
+    messageQueue *q = &queues[classifyMessage(m.message.type)];
+    if (q->count == MAX_QUEUED) {
+      TRACE(TRACE_MESSAGES, TR_IGNORED, m.message.tid, 0, m.message.type);
+      continue;
+    }
+    q->entries[(q->head + q->count++) % MAX_QUEUED] = m;
   }
 }
 
 void processMessage(managerType *message, struct sockaddr_in *client) {
-  receiveMessage(message, client);
+  TRACE(TRACE_MESSAGES, TR_MSG_IN, message->tid, 0, message->type);
 
   switch (message->type) {
   case TXMSG_BEGIN:
     processBegin(message, client);
     break;
+  case TXMSG_LEASE_REQUEST:
+    processLease(message, client);
+    break;
   case TXMSG_JOIN:
     processJoin(message, client);
     break;
@@ -390,6 +1025,28 @@ void processMessage(managerType *message, struct sockaddr_in *client) {
   case TXMSG_VOTE_COMMIT:
     processCommitVote(message, client);
     break;
+  case TXMSG_VOTE_ABORT:
+    processAbortVote(message, client);
+    break;
+  case TXMSG_POLL_RESULT:
+    processPoll(message, client);
+    break;
+  case TXMSG_DONE:
+    processDone(message, client);
+    break;
+  }
+}
+
+void processMessages() {
+  receiveMessages();
+  for (int c = 0; c < NUM_CLASSES; c++) {
+    messageQueue *q = &queues[c];
+    for (int n = 0; q->count && (!q->weight || n < q->weight); n++) {
+      queuedMessage m = q->entries[q->head];
+      q->head = (q->head + 1) % MAX_QUEUED;
+      q->count--;
+      processMessage(&m.message, &m.client);
+    }
   }
 }
 
@@ -401,21 +1058,102 @@ int isTransactionTimedOut(int i) {
   return 0;
 }
 
+int intactEntry(int id) {
+  return txlog->directory[id].checksum == workerChecksum(&txlog->directory[id]);
+}
+
+int intactWorkers(transaction *tx) {
+  for (int w = 0; w < tx->numWorkers; w++) {
+    if (tx->workers[w] >= txlog->numRegistered || !intactEntry(tx->workers[w])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Compare slot i with its checksum. A mismatch means the flush that last
+ * changed it only partly reached the disk before the machine went down.
+ * With TXIO_DURABILITY=strict, outcomes are only sent once their flush is
+ * durable, so nobody has been told about a torn slot and it is aborted. In
+ * group and os mode an outcome may already have gone out for a slot that
+ * is torn now; those modes accept losing the last decisions.
+ */
+void checkTornSlot(int i) {
+  transaction *tx = &txlog->transaction[i];
+  const uint32_t expected = slotChecksum(tx);
+  if (tx->checksum != expected) {
+    printf("Slot %d is torn: checksum %08x, expected %08x\n", i, tx->checksum,
+           expected);
+  } else if (!intactWorkers(tx)) {
+    printf("Slot %d is torn: a participant's directory entry is torn\n",
+           i);
+  } else {
+    return;
+  }
+  if (tx->numWorkers < 0 || tx->numWorkers > MAX_WORKERS) {
+    tx->numWorkers = 0;
+  }
+  for (int w = 0; w < tx->numWorkers; w++) {
+    if (tx->workers[w] >= txlog->numRegistered) {
+      tx->numWorkers = w;
+    }
+  }
+  if (tx->tstate != TX_NOTINUSE) {
+    tx->tstate = TX_ABORTED;
+  }
+  logToFile();
+}
+
+/*
+ * Clear directory entries that do not match their checksum. Slots using
+ * them were aborted by checkTornSlot; the address is gone, so those workers
+ * learn the outcome by polling.
+ */
+void checkTornDirectory() {
+  int torn = 0;
+  for (int id = 0; id < txlog->numRegistered; id++) {
+    if (intactEntry(id)) {
+      continue;
+    }
+    torn = 1;
+    printf("Directory entry %d is torn\n", id);
+    memset(&txlog->directory[id].client, 0,
+           sizeof(txlog->directory[id].client));
+    txlog->directory[id].checksum = workerChecksum(&txlog->directory[id]);
+  }
+  if (torn) {
+    logToFile();
+  }
+}
+
 void recoverFromCrash() {
+  if (txlog->numRegistered < 0 || txlog->numRegistered > MAX_DIRECTORY) {
+    printf("Directory size %d is torn\n", txlog->numRegistered);
+    txlog->numRegistered = MAX_DIRECTORY;
+  }
   for (int i = 0; i < MAX_TX; i++) {
+    checkTornSlot(i);
+  }
+  checkTornDirectory();
+  indexDirectory();
+  for (int i = 0; i < MAX_TX; i++) {
+    TRACE(TRACE_STATE, TR_RECOVER, txlog->transaction[i].txID,
+          txlog->transaction[i].tstate, 0);
+    indexWorkers(i);
     switch (txlog->transaction[i].tstate) {
     case TX_COMMITTED:
-      sendResult(i, TXMSG_COMMITTED);
+      decideTransaction(i, TX_COMMITTED);
       break;
-    case TX_ABORTED:
     case TX_INPROGRESS:
     case TX_VOTING:
-      sendResult(i, TXMSG_ABORTED);
+      // No decision was logged, so none can have been sent: abort.
+    case TX_ABORTED:
+      decideTransaction(i, TX_ABORTED);
       break;
     default:
       break;
     }
-    resetTimer(i);
   }
 }
 
@@ -423,21 +1161,23 @@ int main(int argc, char **argv) {
   processArgs(argc, argv);
   initServer();
   initLogFile();
-  initTransactionLog();
+  if (initTransactionLog()) {
+    recoverFromCrash();
+  }
 
   for (int i = 0;; i = (++i % MAX_TX)) {
-    managerType message;
-    struct sockaddr_in client;
-    bzero(&client, sizeof(client));
-
     if (isTransactionTimedOut(i)) {
-      printf("timeout\n");
-      sendResult(i, TXMSG_ABORTED);
-      resetTimer(i);
-    } else if (txlog->initialized == 0) {
-      recoverFromCrash();
-    } else {
-      processMessage(&message, &client);
+      TRACE(TRACE_STATE, TR_TIMEOUT, txlog->transaction[i].txID,
+            txlog->transaction[i].tstate, 0);
+      // a commit not yet acknowledged by everyone is resent, votes that
+      // did not arrive in time abort
+      decideTransaction(i, txlog->transaction[i].tstate == TX_COMMITTED
+                               ? TX_COMMITTED
+                               : TX_ABORTED);
     }
+    checkParticipants(i);
+    processMessages();
+    servePendingBegins();
+    txioPoll();
   }
 }
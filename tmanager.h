@@ -1,11 +1,26 @@
 #include <netinet/in.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "checksum.h"
+#include "msg.h"
+
 #ifndef TMANAGER_h
 #define TMANGER_h 100
-#define MAX_WORKERS 6
+#define MAX_WORKERS 4096  // at most MAX_PARTICIPANTS, a multiple of 64
+#define WORKER_WORDS (MAX_WORKERS / 64)
 #define MAX_TX 4
+#define MAX_DIRECTORY (MAX_TX * MAX_WORKERS)  // enough for every slot to be full
+#define DIRECTORY_BUCKETS (2 * MAX_DIRECTORY)  // power of two
 #define TIMEOUT 10
+#define MAX_PENDING 16          // BEGINs queued while every slot is in use
+#define MAX_PENDING_PER_HOST 4  // share of the queue one host may hold
+#define PENDING_WAIT_MS 2000    // longest a BEGIN waits before it gets BUSY
+#define MIN_RETRY_MS 50
+#define MAX_QUEUED 64           // received messages per class not handled yet
+#define SUSPECT_MS 500          // silence after which a worker is taken for dead
+#define LEASED_TID_BASE 0x40000000u  // tids from here up are handed out in leases
+#define MAX_LEASE 1024               // tids per lease
 
 typedef enum txState {
   TX_NOTINUSE = 100,
@@ -15,31 +30,113 @@ typedef enum txState {
   TX_COMMITTED
 } transactionState;
 
+// A worker in the directory. Each address gets an entry the first time it
+// takes part in a transaction and keeps it, so slots only log its id.
 typedef struct worker {
   struct sockaddr_in client;
-  int initialized;
+  uint32_t checksum;  // of client, see workerChecksum
 } worker;
 
+// Participants are registered once per address, in the order they joined.
+// Who has voted and who has acknowledged the commit is kept as one bit per
+// participant, so a vote or ack is counted in O(1) and finding those that
+// have not answered takes a pass over MAX_WORKERS / 64 words.
 typedef struct tx {
   unsigned long txID;
   transactionState tstate;
   time_t timer;
-  worker workers[MAX_WORKERS];
+  uint16_t workers[MAX_WORKERS];  // directory ids
   int numWorkers;
   int pendingCrash;
-  int numAnswers;
-  int numYesVotes;
+  int numAnswers;  // participants covered by the votes received
+  int numAcks;
+  int fanout;  // of the commit tree, 0 if PREPARE went to every worker
+  uint64_t voted[WORKER_WORDS];  // sent a yes vote, for its subtree in a tree
+  uint64_t acked[WORKER_WORDS];  // sent TXMSG_DONE for the commit
+  uint32_t checksum;  // as of the last flush, see slotChecksum
 } transaction;
 
+// Checksum of what recovery reads from a slot: its tid, state, fanout and
+// participants. Votes, acks and the timer are not covered; they change
+// without a flush and recovery does not use them.
+static inline uint32_t slotChecksum(const transaction *tx) {
+  const int n = tx->numWorkers >= 0 && tx->numWorkers <= MAX_WORKERS
+                    ? tx->numWorkers
+                    : 0;
+  uint32_t crc = checksum(0, &tx->txID, sizeof(tx->txID));
+  crc = checksum(crc, &tx->tstate, sizeof(tx->tstate));
+  crc = checksum(crc, &tx->numWorkers, sizeof(tx->numWorkers));
+  crc = checksum(crc, &tx->fanout, sizeof(tx->fanout));
+  return checksum(crc, tx->workers, n * sizeof(tx->workers[0]));
+}
+
+static inline uint32_t workerChecksum(const worker *w) {
+  return checksum(0, &w->client, sizeof(w->client));
+}
+
 typedef struct transactionSet {
   int initialized;
+  uint32_t nextTid;  // first tid not leased yet, logged before any is used
   transaction transaction[MAX_TX];
+  int numRegistered;  // directory entries handed out so far
+  worker directory[MAX_DIRECTORY];
 } transactionSet;
 
+// Directory id of each registered address. Open addressing with linear
+// probing, never more than half full. Only kept in memory: it is rebuilt
+// from the log after a restart.
+typedef struct directoryIndex {
+  uint16_t entry[DIRECTORY_BUCKETS];  // directory id + 1, 0 if free
+} directoryIndex;
+
+// Where each participant of a slot is in its workers array, by directory
+// id. Only kept in memory as well.
+typedef struct participantIndex {
+  uint16_t position[MAX_DIRECTORY];  // position in workers + 1, 0 if none
+} participantIndex;
+
+// A BEGIN waiting for a free slot. The queue only lives in memory: after a
+// manager crash the workers time out and begin again.
+typedef struct pendingBegin {
+  unsigned long txID;
+  struct sockaddr_in client;
+  long long queuedAt;  // ms
+} pendingBegin;
+
+// Received messages wait in one queue per class. Messages that move running
+// transactions towards their end (votes, commit and abort requests, polls,
+// acks) are handled before JOINs, and JOINs before BEGINs. Each round a
+// class gets at most its weight of messages, 0 meaning all it has queued.
+enum messageClass { CLASS_FINISH, CLASS_JOIN, CLASS_BEGIN, NUM_CLASSES };
+
+typedef struct queuedMessage {
+  managerType message;
+  struct sockaddr_in client;
+} queuedMessage;
+
+typedef struct messageQueue {
+  queuedMessage entries[MAX_QUEUED];
+  int head;
+  int count;
+  int weight;
+} messageQueue;
+
 int sockfd;
 unsigned long port;
 char logFileName[128];
 int logfileFD;
 transactionSet *txlog;
+int commitFanout; // TXFANOUT, 0 for a flat commit
+pendingBegin pending[MAX_PENDING];
+int numPending;
+struct in_addr lastAdmittedHost;
+long long slotStart[MAX_TX];  // ms a slot was handed out
+long long avgHoldMs;          // how long slots are held, on average
+messageQueue queues[NUM_CLASSES];
+directoryIndex registered;
+participantIndex participants[MAX_TX];
+int suspectMs;                            // TXSUSPECT, 0 to rely on TIMEOUT
+long long lastHeard[MAX_TX][MAX_WORKERS]; // ms of each worker's last heartbeat
+long long nextCheck[MAX_TX];              // ms the slot is checked again
 
 #endif
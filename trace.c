@@ -0,0 +1,257 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "trace.h"
+
+#define RING_SIZE 4096  // records, power of two
+#define DRAIN_INTERVAL_NS 10000000
+
+// Multi-producer ring (any thread may trace) with a single consumer, the
+// drain thread. Each slot carries a sequence number telling producers and
+// the consumer whose turn it is, so neither side ever takes a lock. When the
+// ring is full new records are dropped and counted.
+struct slot {
+	uint64_t seq;
+	struct traceRecord rec;
+};
+
+volatile sig_atomic_t traceLevel = TRACE_MESSAGES;
+
+static struct slot ring[RING_SIZE];
+static uint64_t ringTail;  // next slot a producer claims
+static uint64_t ringHead;  // next slot the consumer reads
+static uint64_t dropped;
+static enum traceProcKind procKind;
+static int traceFD = -1;
+static pthread_t drainThread;
+static pthread_mutex_t drainLock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t nowNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void echo(const struct traceRecord* rec) {
+	printf("[TRACE] %s tid %u, %s", traceEventName(rec->event), rec->tid,
+		traceStateName(procKind, rec->state));
+	switch (rec->event) {
+		case TR_COMMAND:
+			printf(", %s\n", traceCommandName(rec->arg));
+			break;
+		case TR_MSG_IN:
+		case TR_MSG_OUT:
+		case TR_IGNORED:
+			printf(", %s\n", traceMessageName(rec->arg));
+			break;
+		default:
+			printf(", %u\n", rec->arg);
+	}
+}
+
+void traceEvent(enum traceEventKind event, uint32_t tid, uint32_t state, uint32_t arg) {
+	struct traceRecord rec = { nowNs(), tid, event, 0, state, arg };
+	if (traceLevel >= TRACE_ECHO) echo(&rec);
+	if (traceFD < 0) return;
+
+	uint64_t pos = __atomic_load_n(&ringTail, __ATOMIC_RELAXED);
+	while (1) {
+		struct slot* s = &ring[pos & (RING_SIZE - 1)];
+		int64_t diff = (int64_t) (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ringTail, &pos, pos + 1, 1,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				s->rec = rec;
+				__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+				return;
+			}
+		} else if (diff < 0) {
+			__atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+			return;
+		} else {
+			pos = __atomic_load_n(&ringTail, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/**
+ * Move everything published so far from the ring to the file. Returns the
+ * number of records written.
+ */
+static int drain() {
+	static struct traceRecord batch[256];
+	int total = 0;
+	pthread_mutex_lock(&drainLock);
+	while (1) {
+		int n = 0;
+		while (n < sizeof(batch) / sizeof(batch[0])) {
+			struct slot* s = &ring[ringHead & (RING_SIZE - 1)];
+			if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != ringHead + 1) break;
+			batch[n++] = s->rec;
+			__atomic_store_n(&s->seq, ringHead + RING_SIZE, __ATOMIC_RELEASE);
+			ringHead++;
+		}
+		if (!n) break;
+		if (write(traceFD, batch, n * sizeof(batch[0])) != n * sizeof(batch[0])) {
+			perror("Writing trace");
+		}
+		total += n;
+	}
+	pthread_mutex_unlock(&drainLock);
+	return total;
+}
+
+static void* drainMain(void* arg) {
+	const struct timespec pause = { 0, DRAIN_INTERVAL_NS };
+	while (1) {
+		if (!drain()) nanosleep(&pause, NULL);
+	}
+	return NULL;
+}
+
+void traceFlush() {
+	if (traceFD >= 0) drain();
+	uint64_t lost = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (lost) printf("Trace ring overflowed, %llu records dropped\n", (unsigned long long) lost);
+	fflush(stdout);
+}
+
+static void adjustLevel(int sig) {
+	if (sig == SIGUSR1 && traceLevel < TRACE_ECHO) traceLevel++;
+	if (sig == SIGUSR2 && traceLevel > TRACE_OFF) traceLevel--;
+}
+
+void traceInit(enum traceProcKind kind, unsigned long port, const char* fileName) {
+	procKind = kind;
+	for (uint64_t i = 0; i < RING_SIZE; i++) ring[i].seq = i;
+
+	const char* level = getenv("TXTRACE");
+	if (level) traceLevel = atoi(level);
+	signal(SIGUSR1, adjustLevel);
+	signal(SIGUSR2, adjustLevel);
+
+	traceFD = open(fileName, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+	if (traceFD < 0) {
+		perror("Opening trace file");
+		return;
+	}
+	struct stat st;
+	if (fstat(traceFD, &st) == 0 && st.st_size == 0) {
+		struct traceHeader hdr;
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+		hdr.kind = kind;
+		hdr.port = port;
+		if (write(traceFD, &hdr, sizeof(hdr)) != sizeof(hdr)) perror("Writing trace");
+	}
+	atexit(traceFlush);
+	if (pthread_create(&drainThread, NULL, drainMain, NULL)) {
+		perror("Starting trace thread");
+		exit(-1);
+	}
+	traceEvent(TR_START, 0, 0, port);
+}
+
+const char* traceEventName(uint32_t event) {
+	static const char* names[] = {
+		"START",
+		"RECOVER",
+		"COMMAND",
+		"MSG_IN",
+		"MSG_OUT",
+		"STATE",
+		"COMMIT",
+		"ABORT",
+		"TIMEOUT",
+		"IGNORED",
+		"CRASH",
+		"SUSPECT"
+	};
+	if (event < TR_START || event > TR_SUSPECT) return "?";
+	return names[event - TR_START];
+}
+
+const char* traceCommandName(uint32_t kind) {
+	static const char* names[] = {
+		"BEGINTX",
+		"JOINTX",
+		"NEW_A",
+		"NEW_B",
+		"NEW_ID",
+		"DELAY_RESPONSE",
+		"CRASH",
+		"COMMIT",
+		"COMMIT_CRASH",
+		"ABORT",
+		"ABORT_CRASH",
+		"VOTE_ABORT",
+		"READ",
+		"NEW_BATCH",
+		"NEW_VALUE",
+		"OUTCOME"
+	};
+	if (kind < BEGINTX || kind > OUTCOME) return "?";
+	return names[kind - BEGINTX];
+}
+
+const char* traceMessageName(uint32_t kind) {
+	static const char* names[] = {
+		"TXMSG_BEGIN",
+		"TXMSG_JOIN",
+		"TXMSG_TID_OK",
+		"TXMSG_TID_BAD",
+		"TXMSG_COMMIT_REQUEST",
+		"TXMSG_COMMIT_CRASH_REQUEST",
+		"TXMSG_ABORT_REQUEST",
+		"TXMSG_ABORT_CRASH_REQUEST",
+		"TXMSG_PREPARE_TO_COMMIT",
+		"TXMSG_VOTE_COMMIT",
+		"TXMSG_VOTE_ABORT",
+		"TXMSG_COMMITTED",
+		"TXMSG_POLL_RESULT",
+		"TXMSG_ABORTED",
+		"TXMSG_BUSY",
+		"TXMSG_DONE",
+		"TXMSG_DECISION_REQUEST",
+		"TXMSG_HEARTBEAT",
+		"TXMSG_LEASE_REQUEST",
+		"TXMSG_LEASE_GRANT"
+	};
+	if (kind < TXMSG_BEGIN || kind > TXMSG_LEASE_GRANT) return "?";
+	return names[kind - TXMSG_BEGIN];
+}
+
+const char* traceStateName(enum traceProcKind proc, uint32_t state) {
+	// tmanager's txState starts at TX_NOTINUSE = 100; tmanager.h holds the
+	// manager's globals, so it cannot be included here.
+	static const char* managerNames[] = {
+		"TX_NOTINUSE",
+		"TX_INPROGRESS",
+		"TX_VOTING",
+		"TX_ABORTED",
+		"TX_COMMITTED"
+	};
+	static const char* workerNames[] = {
+		"WTX_NOTACTIVE",
+		"WTX_ABORTED",
+		"WTX_PREPARED",
+		"WTX_COMMITTED",
+		"WTX_INITIATED",
+		"WTX_IN_PROGRESS"
+	};
+	if (proc == TRACE_MANAGER && state >= 100 && state < 100 + 5) {
+		return managerNames[state - 100];
+	}
+	if (proc == TRACE_WORKER && state >= WTX_NOTACTIVE && state <= WTX_IN_PROGRESS) {
+		return workerNames[state - WTX_NOTACTIVE];
+	}
+	return "-";
+}
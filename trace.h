@@ -0,0 +1,83 @@
+#ifndef TRACE_H
+#define TRACE_H 1
+#include <signal.h>
+#include <stdint.h>
+
+// Binary event tracing. Events are fixed-size records pushed onto a
+// lock-free ring buffer and written to <log name>.trace by a background
+// thread, so tracing a packet costs a few stores instead of a printf.
+// txtrace renders the files as per-transaction timelines.
+//
+// The level is read from TXTRACE at startup (default TRACE_MESSAGES) and can
+// be changed at runtime: SIGUSR1 raises it, SIGUSR2 lowers it.
+
+#define TRACE_MAGIC "TXTRACE1"
+
+enum traceLevel {
+	TRACE_OFF = 0,
+	TRACE_STATE,     // state changes, decisions, timeouts and recovery
+	TRACE_MESSAGES,  // plus every command and message sent or received
+	TRACE_ECHO       // plus a text line on stdout for every record
+};
+
+enum traceProcKind {
+	TRACE_MANAGER = 1,
+	TRACE_WORKER
+};
+
+enum traceEventKind {
+	TR_START = 1,     // arg: port
+	TR_RECOVER,       // state: state found in the log
+	TR_COMMAND,       // arg: cmdMsgKind
+	TR_MSG_IN,        // arg: txMsgKind
+	TR_MSG_OUT,       // arg: txMsgKind
+	TR_STATE,         // state: new state
+	TR_COMMIT,        // outcome applied
+	TR_ABORT,         // outcome applied
+	TR_TIMEOUT,
+	TR_IGNORED,       // arg: txMsgKind of a message that was dropped
+	TR_CRASH,         // injected crash
+	TR_SUSPECT        // participant stopped sending heartbeats; arg: its port
+};
+
+struct traceHeader {
+	char magic[8];
+	uint32_t kind;
+	uint32_t port;
+};
+
+struct traceRecord {
+	uint64_t time;  // ns since the epoch
+	uint32_t tid;
+	uint16_t event;
+	uint16_t pad;
+	uint32_t state;
+	uint32_t arg;
+};
+
+extern volatile sig_atomic_t traceLevel;
+
+/**
+ * Start tracing to fileName and spawn the thread that drains the ring.
+ */
+void traceInit(enum traceProcKind kind, unsigned long port, const char* fileName);
+
+void traceEvent(enum traceEventKind event, uint32_t tid, uint32_t state, uint32_t arg);
+
+/**
+ * Write out everything recorded so far. Called before injected crashes so
+ * the trace shows how the process got there.
+ */
+void traceFlush(void);
+
+#define TRACE(level, event, tid, state, arg) \
+	do { \
+		if (traceLevel >= (level)) traceEvent((event), (tid), (state), (arg)); \
+	} while (0)
+
+const char* traceEventName(uint32_t event);
+const char* traceCommandName(uint32_t kind);
+const char* traceMessageName(uint32_t kind);
+const char* traceStateName(enum traceProcKind proc, uint32_t state);
+
+#endif /* TRACE_H */
@@ -13,27 +13,97 @@
 #include <unistd.h>
 #include <time.h>
 
+#include "capture.h"
 #include "msg.h"
+#include "trace.h"
 #include "tworker.h"
+#include "txio.h"
 
 static struct logFile *log;
 static int cmdSock;
 static int txSock;
 static struct addrinfo hints;
 static time_t latestResponseTime = 0, rePollTime = 0;  // timeouts
-static time_t delayedResponseTime = 0;
+static long long delayedResponseTime = 0;  // ms, when the pending vote is sent
+static long long beginRetryAt = 0;  // ms, resend BEGIN after a BUSY reply
+static int heartbeatMs = HEARTBEAT_MS;  // TXHEARTBEAT, 0 for none
+static long long nextHeartbeat = 0;     // ms
+static uint32_t joinedTid = 0;  // transaction joined since this process started
+static uint32_t earlyVoteTid = 0;  // transaction voted for with the commit request
+static int applyingCommit = 0;  // committed values flushed, waiting for them to be durable
+
+// Bytes of the arena written since the last flush.
+static struct {
+	uint32_t lo, hi;
+} arenaDirty;
+
+// Tids leased from a manager for BEGINs that do not name one. Not logged: a
+// restarted worker leases new ones and the rest go unused.
+static struct {
+	struct sockaddr_in manager;
+	uint32_t next;
+	uint32_t end;
+} lease;
+
+// Vote collection for the PREPARE that came with a participant list. In a
+// flat commit the worker has no children and just votes to the manager.
+// Nothing here is logged: a worker that restarts no longer votes for its
+// subtree and the manager times the transaction out.
+static struct {
+	uint32_t tid;               // 0 if PREPARE came without a participant list
+	struct sockaddr_in parent;  // sender of PREPARE, gets the subtree's vote
+	int children[MAX_PARTICIPANTS];
+	int numChildren;
+	uint64_t voted;             // bit j: child j has voted
+	int numVoted;
+	uint32_t yesVotes;          // participants covered by the children's votes
+	int childAborted;
+	enum txMsgKind ownVote;     // 0 until this worker's vote is logged
+	int reported;               // the subtree's vote has been sent
+} tree;
 static enum txMsgKind delayedVoteValue = TXMSG_VOTE_COMMIT;
 static enum txMsgKind voteValue = TXMSG_VOTE_COMMIT;  // by default, commit
 static int crashAfterDelay = 0;
 static long delay = 0;
 
 
+static void reclaimBlocks(void* group) {
+	slabReclaim((uintptr_t) group);
+}
+
+static void flushRegion(size_t off, size_t len) {
+	txioFlushRange((char*) log + off, len);
+}
+
+/**
+ * Flush every region of the log that changed since the previous flush,
+ * going by its checksum, and the values written since then.
+ */
 static void flushAll() {
 	if (!log->initialized) log->initialized = 1;
-	if (msync(log, sizeof(struct logFile), MS_SYNC | MS_INVALIDATE)) {
-		perror("Msync problem");
-		exit(-1);
+	const uint32_t meta = logMetaChecksum(log);
+	const uint32_t data = logDataChecksum(log);
+	const uint32_t tx = logTxChecksum(log);
+	const int newValues = arenaDirty.hi > arenaDirty.lo;
+	if (newValues) {
+		flushRegion(LOG_ARENA_OFFSET + arenaDirty.lo, arenaDirty.hi - arenaDirty.lo);
+		arenaDirty.lo = arenaDirty.hi = 0;
+	}
+	if (newValues || meta != log->metaChecksum) {
+		log->metaChecksum = meta;
+		flushRegion(LOG_META_OFFSET, LOG_META_LEN);
+	}
+	if (data != log->dataChecksum) {
+		log->dataChecksum = data;
+		flushRegion(LOG_DATA_OFFSET, LOG_DATA_LEN);
+	}
+	if (tx != log->txChecksum) {
+		log->txChecksum = tx;
+		flushRegion(LOG_TX_OFFSET, logTxLen(log));
 	}
+	// values dropped before this flush may be reused once it is durable
+	const uint32_t group = slabSeal();
+	if (group) txioOnDurable(reclaimBlocks, (void*) (uintptr_t) group);
 }
 
 // Flush changes to the log file.
@@ -49,17 +119,37 @@ static void flushLog() {
 inline static void setWorkerState(enum workerTxState state) {
 	log->log.txState = state;
 	flushLog();
+	TRACE(TRACE_STATE, TR_STATE, log->log.txID, state, 0);
 }
 
 inline static uint32_t currState() {
 	return log->log.txState;
 }
 
+static long long nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void usage(char *cmd) {
 	printf("usage: %s  cmdportNum txportNum\n",
 		   cmd);
 }
 
+/**
+ * Rebuild the value arena's free lists: everything except the committed
+ * value and the redo records of the logged transaction is free.
+ */
+static void recoverArena() {
+	struct slabRef live[3];
+	int numLive = 0;
+	live[numLive++] = log->value;
+	if (log->log.newSaved & 1) live[numLive++] = log->log.newIDstring;
+	if ((log->log.newSaved >> 3) & 1) live[numLive++] = log->log.newValue;
+	slabRecover(&log->arena, (char*) log + LOG_ARENA_OFFSET, LOG_ARENA_SIZE, live, numLive);
+}
+
 static void setup(int argc, char **argv) {
 	if (argc != 3) {
 		usage(argv[0]);
@@ -84,6 +174,14 @@ static void setup(int argc, char **argv) {
 	/* got the port number create a logfile name */
 	snprintf(logFileName, sizeof(logFileName), "TXworker_%lu.log", cmdPort);
 
+	char traceFileName[128];
+	snprintf(traceFileName, sizeof(traceFileName), "TXworker_%lu.trace", cmdPort);
+	traceInit(TRACE_WORKER, cmdPort, traceFileName);
+
+	char captureFileName[128];
+	snprintf(captureFileName, sizeof(captureFileName), "TXworker_%lu.capture", cmdPort);
+	captureInit(cmdPort, captureFileName);
+
 	int logfileFD;
 
 	logfileFD = open(logFileName, O_RDWR | O_CREAT | O_SYNC, S_IRUSR | S_IWUSR);
@@ -114,13 +212,18 @@ static void setup(int argc, char **argv) {
 			exit(EXIT_FAILURE);
 		}
 	}
+	if (fstatus.st_size < LOG_FILE_SIZE && ftruncate(logfileFD, LOG_FILE_SIZE)) {
+		perror("Could not make room for the value arena");
+		exit(EXIT_FAILURE);
+	}
 
 	// Now map the file in.
-	log = mmap(NULL, 512, PROT_READ | PROT_WRITE, MAP_SHARED, logfileFD, 0);
-	if (log == NULL) {
+	log = mmap(NULL, LOG_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, logfileFD, 0);
+	if (log == MAP_FAILED) {
 		perror("Log file could not be mapped in:");
 		exit(EXIT_FAILURE);
 	}
+	recoverArena();
 
 	cmdSock = socket(AF_INET, SOCK_DGRAM, 0);
 	if (cmdSock < 0) {
@@ -154,6 +257,11 @@ static void setup(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	txioInit(logfileFD, log, LOG_FILE_SIZE);
+	txioReceiveThread();
+	txioWatch(cmdSock);
+	txioWatch(txSock);
+
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_socktype = SOCK_DGRAM;
 	hints.ai_family = AF_INET;
@@ -162,101 +270,234 @@ static void setup(int argc, char **argv) {
 	printf("Command port:  %lu\n", cmdPort);
 	printf("TX port:       %lu\n", txPort);
 	printf("Log file name: %s\n", logFileName);
-}
+	printf("I/O backend:   %s\n", txioBackendName());
+	printf("Log syncs:     %s\n", txioLogModeName());
+	printf("Durability:    %s\n", txioDurabilityName());
+	printf("Local peers:   %s\n", txioLocalName());
+	printf("Receive:       %s\n", txioReceiveName());
+	printf("Capture:       %s\n", captureEnabled() ? captureFileName : "off");
 
-static void* receivePacket(int sockfd, void* buf, int buflen, struct sockaddr* sender, socklen_t* addrLen) {
-	int res = recvfrom(sockfd, buf, buflen, MSG_DONTWAIT, sender, addrLen);
-	if (res == buflen) return buf;
-	if (res != -1) printf("Received packet with invalid size: %d\n", res);
-	else if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Receive packet error");
-	return NULL;
+	const char* heartbeat = getenv("TXHEARTBEAT");
+	if (heartbeat) heartbeatMs = atoi(heartbeat);
+	if (heartbeatMs > 0) printf("Heartbeats:    every %d ms\n", heartbeatMs);
+	else printf("Heartbeats:    off\n");
 }
 
 /**
  * Check for incoming messages in a non-blocking fashion.
- * Returns a pointer to the command, or NULL if none was present.
+ * Returns a pointer to the message, or NULL if none was present. A tree
+ * PREPARE is longer than a managerType and starts with one; *len tells
+ * them apart.
  */
-static const managerType* receiveMessage() {
-	static managerType message;
-	return receivePacket(txSock, &message, sizeof(message), NULL, NULL);
+static const managerType* receiveMessage(struct sockaddr_in* sender, int* len) {
+	static prepareType packet;
+	int res = txioRecv(txSock, &packet, sizeof(packet), sender);
+	if (res == -1) return NULL;
+	*len = res;
+	if (res == sizeof(managerType)) return &packet.hdr;
+	if (res >= (int) PREPARE_SIZE(0) && packet.hdr.type == TXMSG_PREPARE_TO_COMMIT
+			&& packet.count <= MAX_PARTICIPANTS && packet.fanout <= MAX_FANOUT
+			&& res == PREPARE_SIZE(packet.count)) {
+		return &packet.hdr;
+	}
+	printf("Received packet with invalid size: %d\n", res);
+	return NULL;
 }
 
 /**
  * Check for incoming commands in a non-blocking fashion.
- * Returns a pointer to the command, or NULL if none was present.
+ * Returns a pointer to the command, or NULL if none was present. The
+ * payload of a NEW_VALUE follows the command in the same buffer.
  */
-static const msgType* receiveCommand() {
-	static msgType command;
-	return receivePacket(cmdSock, &command, sizeof(command), NULL, NULL);
-}
-
-static const char* getManagerTypeString(uint32_t msgType) {
-	static const char* names[] = {
-		"TXMSG_BEGIN",
-		"TXMSG_JOIN",
-		"TXMSG_TID_OK",
-		"TXMSG_TID_BAD",
-		"TXMSG_COMMIT_REQUEST",
-		"TXMSG_COMMIT_CRASH_REQUEST",
-		"TXMSG_ABORT_REQUEST",
-		"TXMSG_ABORT_CRASH_REQUEST",
-		"TXMSG_PREPARE_TO_COMMIT",
-		"TXMSG_VOTE_COMMIT",
-		"TXMSG_VOTE_ABORT",
-		"TXMSG_COMMITTED",
-		"TXMSG_POLL_RESULT",
-		"TXMSG_ABORTED"
-	};
-	return names[msgType - TXMSG_BEGIN];
-}
-
-static const char* getCommandTypeString(uint32_t msgType) {
-	static const char* names[] = {
-		"BEGINTX",
-		"JOINTX",
-		"NEW_A",
-		"NEW_B",
-		"NEW_ID",
-		"DELAY_RESPONSE",
-		"CRASH",
-		"COMMIT",
-		"COMMIT_CRASH",
-		"ABORT",
-		"ABORT_CRASH",
-		"VOTE_ABORT"
-	};
-	return names[msgType - BEGINTX];
+static const msgType* receiveCommand(struct sockaddr_in* sender) {
+	static struct {
+		msgType command;
+		char payload[VALUE_MAX];
+	} packet;
+	int res = txioRecv(cmdSock, &packet, sizeof(packet), sender);
+	if (res == -1) return NULL;
+	if (res >= (int) sizeof(msgType) && packet.command.msgID == NEW_VALUE) {
+		if (packet.command.newValue >= 0 && packet.command.newValue <= VALUE_MAX
+				&& res == sizeof(msgType) + packet.command.newValue) {
+			return &packet.command;
+		}
+	} else if (res == sizeof(msgType)) {
+		return &packet.command;
+	}
+	printf("Received packet with invalid size: %d\n", res);
+	return NULL;
 }
 
-static void printCommand(const msgType* command) {
-	printf("[COMMAND] ");
-	printf("%s: ", getCommandTypeString(command->msgID));
-	printf("tid: %u, ", command->tid);
-	printf("port: %u, ", command->port);
-	printf("newVal: %d, ", command->newValue);
-	printf("delay: %d, ", command->delay);
-	printf("str: %s\n", command->strData.newID);
+static void sendMessage(const managerType* msg) {
+	TRACE(TRACE_MESSAGES, TR_MSG_OUT, msg->tid, currState(), msg->type);
+	txioSend(txSock, msg, sizeof(*msg), &log->log.transactionManager);
 }
 
-static void printMessage(const managerType* msg) {
-	printf("[MESSAGE] ");
-	printf("%s (%d): ", getManagerTypeString(msg->type), msg->type);
-	printf("tid: %u\n", msg->tid);
+/**
+ * Send a message that depends on the log state written so far; it leaves
+ * once that state is on disk.
+ */
+static void sendDurableMessage(const managerType* msg) {
+	TRACE(TRACE_MESSAGES, TR_MSG_OUT, msg->tid, currState(), msg->type);
+	txioSendDurable(txSock, msg, sizeof(*msg), &log->log.transactionManager);
 }
 
-static void sendMessage(const managerType* msg) {
-	struct sockaddr* addr = (struct sockaddr*) &log->log.transactionManager;
-	int addrSize = sizeof(log->log.transactionManager);
-	if (sendto(txSock, msg, sizeof(*msg), 0, addr, addrSize) != sizeof(*msg)) {
-		perror("Error sending message: ");
+static void participantAddr(int i, struct sockaddr_in* addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = log->log.peers[i].addr;
+	addr->sin_port = log->log.peers[i].port;
+}
+
+/**
+ * Take the participant list from PREPARE into the log, where it is flushed
+ * with the PREPARED state. In a tree commit this worker then becomes the
+ * sub-coordinator of the subtree below it and passes PREPARE on to its
+ * children.
+ */
+static void startTree(const prepareType* prepare, const struct sockaddr_in* sender) {
+	static prepareType forward;
+	memset(&tree, 0, sizeof(tree));
+	tree.tid = prepare->hdr.tid;
+	tree.parent = *sender;
+	log->log.numPeers = prepare->count;
+	log->log.selfIndex = prepare->hdr.arg;
+	log->log.fanout = prepare->fanout;
+	memcpy(log->log.peers, prepare->participants, prepare->count * sizeof(prepare->participants[0]));
+	memcpy(&forward, prepare, PREPARE_SIZE(prepare->count));
+
+	const int self = prepare->hdr.arg;
+	for (int j = 0; j < prepare->fanout; j++) {
+		const int child = TREE_CHILD(prepare->fanout, self, j);
+		if (child >= prepare->count) break;
+		tree.children[tree.numChildren++] = child;
+		struct sockaddr_in addr;
+		participantAddr(child, &addr);
+		forward.hdr.arg = child;
+		TRACE(TRACE_MESSAGES, TR_MSG_OUT, tree.tid, currState(), TXMSG_PREPARE_TO_COMMIT);
+		txioSend(txSock, &forward, PREPARE_SIZE(prepare->count), &addr);
+	}
+}
+
+/**
+ * Ask every other participant for the outcome. Those that know it answer
+ * with TXMSG_COMMITTED or TXMSG_ABORTED, the others stay silent.
+ */
+static void queryPeers() {
+	const managerType msg = { log->log.txID, TXMSG_DECISION_REQUEST };
+	for (uint32_t i = 0; i < log->log.numPeers && i < MAX_PARTICIPANTS; i++) {
+		if (i == log->log.selfIndex) continue;
+		struct sockaddr_in addr;
+		participantAddr(i, &addr);
+		TRACE(TRACE_MESSAGES, TR_MSG_OUT, msg.tid, currState(), msg.type);
+		txioSend(txSock, &msg, sizeof(msg), &addr);
+	}
+}
+
+static void rememberDecision(uint32_t outcome) {
+	struct recentDecision* d = &log->recent[log->recentNext % RECENT_DECISIONS];
+	d->tid = log->log.txID;
+	d->outcome = outcome;
+	log->recentNext = (log->recentNext + 1) % RECENT_DECISIONS;
+}
+
+static uint32_t recentDecision(uint32_t tid) {
+	for (int i = 1; i <= RECENT_DECISIONS; i++) {
+		const struct recentDecision* d =
+			&log->recent[(log->recentNext + RECENT_DECISIONS - i) % RECENT_DECISIONS];
+		if (d->outcome && d->tid == tid) return d->outcome;
+	}
+	return 0;
+}
+
+/**
+ * Send the subtree's vote up once it is known: abort as soon as anyone in
+ * it votes abort, commit once this worker and every child voted commit.
+ */
+static void reportTreeVote() {
+	if (tree.reported) return;
+	managerType msg = { tree.tid, TXMSG_VOTE_ABORT };
+	if (tree.childAborted || tree.ownVote == TXMSG_VOTE_ABORT) {
+		TRACE(TRACE_MESSAGES, TR_MSG_OUT, msg.tid, currState(), msg.type);
+		txioSend(txSock, &msg, sizeof(msg), &tree.parent);
+	} else if (tree.ownVote == TXMSG_VOTE_COMMIT && tree.numVoted == tree.numChildren) {
+		msg.type = TXMSG_VOTE_COMMIT;
+		msg.arg = 1 + tree.yesVotes;
+		TRACE(TRACE_MESSAGES, TR_MSG_OUT, msg.tid, currState(), msg.type);
+		txioSendDurable(txSock, &msg, sizeof(msg), &tree.parent);
+	} else {
+		return;
+	}
+	tree.reported = 1;
+}
+
+static void childVote(const managerType* msg, const struct sockaddr_in* sender) {
+	if (tree.tid != msg->tid) return;
+	for (int j = 0; j < tree.numChildren; j++) {
+		struct sockaddr_in addr;
+		participantAddr(tree.children[j], &addr);
+		if (addr.sin_addr.s_addr != sender->sin_addr.s_addr || addr.sin_port != sender->sin_port
+				|| (tree.voted >> j) & 1) {
+			continue;
+		}
+		tree.voted |= (uint64_t) 1 << j;
+		tree.numVoted++;
+		if (msg->type == TXMSG_VOTE_COMMIT) tree.yesVotes += msg->arg ? msg->arg : 1;
+		else tree.childAborted = 1;
+		reportTreeVote();
+		return;
 	}
 }
 
-static void initiateTransaction(const msgType* command) {
+/**
+ * Pass a commit decision down the tree.
+ */
+static void forwardDecision(const managerType* msg) {
+	if (tree.tid != msg->tid) return;
+	for (int j = 0; j < tree.numChildren; j++) {
+		struct sockaddr_in addr;
+		participantAddr(tree.children[j], &addr);
+		TRACE(TRACE_MESSAGES, TR_MSG_OUT, msg->tid, currState(), msg->type);
+		txioSend(txSock, msg, sizeof(*msg), &addr);
+	}
+}
+
+static void sendOutcome(uint32_t tid, uint32_t outcome, const struct sockaddr_in* to) {
+	const outcomeType msg = { OUTCOME, tid, outcome };
+	txioSendDurable(cmdSock, &msg, sizeof(msg), to);
+}
+
+/**
+ * Tell the client that asked for it how the transaction ended. Called once
+ * the outcome has been flushed.
+ */
+static void notifyOutcome(uint32_t outcome) {
+	if (!log->log.notify.sin_port) return;
+	sendOutcome(log->log.txID, outcome, &log->log.notify);
+	log->log.notify.sin_port = 0;
+}
+
+/**
+ * A COMMIT or ABORT with notify set: remember who to tell, or answer right
+ * away if it is about a transaction that is already over. Returns whether
+ * the command should still be carried out.
+ */
+static int watchOutcome(const msgType* command, const struct sockaddr_in* sender) {
+	const uint32_t tid = command->tid ? command->tid : log->log.txID;
+	if (currState() == WTX_NOTACTIVE || tid != log->log.txID) {
+		sendOutcome(tid, recentDecision(tid), sender);
+		return 0;
+	}
+	log->log.notify = *sender;
+	return 1;
+}
+
+static void initiateTransaction(const msgType* command, const struct sockaddr_in* sender) {
 	static struct addrinfo* serverInfo = NULL;
 
 	if (currState() != WTX_NOTACTIVE) {
 		printf("Another transaction is currently ongoing (current status: %d).\n", currState());
+		if (command->notify) sendOutcome(command->tid, TXMSG_TID_BAD, sender);
 		return;
 	}
 
@@ -269,124 +510,404 @@ static void initiateTransaction(const msgType* command) {
 		exit(EXIT_FAILURE);
 	}
 
-	log->log.txID = command->tid;
+	const struct sockaddr_in* manager = (struct sockaddr_in *) serverInfo->ai_addr;
+	uint32_t tid = command->tid;
+	const int leased = command->msgID == BEGINTX && !tid;
+	if (leased && lease.next < lease.end && lease.manager.sin_addr.s_addr == manager->sin_addr.s_addr
+			&& lease.manager.sin_port == manager->sin_port) {
+		tid = lease.next++;
+	}
+
+	log->log.txID = tid;
+	log->log.transactionManager = *manager;
+	if (command->notify) log->log.notify = *sender;
+	else log->log.notify.sin_port = 0;
 	setWorkerState(WTX_INITIATED);
-	log->log.transactionManager = *((struct sockaddr_in *) serverInfo->ai_addr);
+	latestResponseTime = time(NULL) + RESPONSE_TIME_LIMIT;
 
+	if (leased && !tid) {
+		// BEGIN once the manager has handed out more tids
+		const managerType msg = { 0, TXMSG_LEASE_REQUEST, LEASE_SIZE };
+		sendMessage(&msg);
+		return;
+	}
 	uint32_t msgType = command->msgID == BEGINTX ? TXMSG_BEGIN : TXMSG_JOIN;
-	managerType msg = {command->tid, msgType};
-	sendMessage(&msg);
-	latestResponseTime = time(NULL) + RESPONSE_TIME_LIMIT;
+	managerType msg = {tid, msgType};
+	sendDurableMessage(&msg);
+}
+
+/**
+ * New tids for the BEGIN that was waiting for them.
+ */
+static void leaseGranted(const managerType* msg, const struct sockaddr_in* sender) {
+	if (currState() != WTX_INITIATED || log->log.txID || !msg->arg) return;
+	lease.manager = *sender;
+	lease.next = msg->tid;
+	lease.end = msg->tid + msg->arg;
+	log->log.txID = lease.next++;
+	setWorkerState(WTX_INITIATED);
+	const managerType begin = { log->log.txID, TXMSG_BEGIN };
+	sendDurableMessage(&begin);
 }
 
 static void resetTimers() {
 	latestResponseTime = 0;
 	rePollTime = 0;
 	delayedResponseTime = 0;
+	beginRetryAt = 0;
 }
 
-static void commitTransaction() {
-	memcpy(&log->txData.IDstring, &log->log.newIDstring, IDLEN);
-	memcpy(&log->txData.B, &log->log.newB, sizeof(int));
-	memcpy(&log->txData.A, &log->log.newA, sizeof(int));
+/**
+ * Forget a redo record held in the arena.
+ */
+static void dropRef(struct slabRef* ref) {
+	slabRetire(ref->off);
+	ref->off = 0;
+	ref->len = 0;
+}
+
+/**
+ * Second half of a commit, once the committed values are durable: drop the
+ * redo records and leave the transaction. Until now the log still showed
+ * the transaction prepared with its redo records, so a crash in between
+ * only applies them again.
+ */
+static void finishCommit(void* arg) {
+	if (log->log.newSaved & 1) dropRef(&log->log.newIDstring);
+	// newValue became the committed value, its block stays
+	log->log.newValue.off = 0;
+	log->log.newValue.len = 0;
+	log->log.newSaved = 0;
+	rememberDecision(TXMSG_COMMITTED);
+	// clears notify, which the flush below has to cover
+	notifyOutcome(TXMSG_COMMITTED);
+	applyingCommit = 0;
 	setWorkerState(WTX_NOTACTIVE);
-	log->log.oldSaved = 0;
-	flushAll();
-	resetTimers();
+	TRACE(TRACE_STATE, TR_COMMIT, log->log.txID, currState(), 0);
+	// lets the manager forget the transaction
+	const managerType done = { log->log.txID, TXMSG_DONE };
+	sendDurableMessage(&done);
 }
 
-static void abortTransaction() {
-	printf("Aborting transaction.\n");
-	if (log->log.oldSaved & 1) {
-		memcpy(&log->txData.IDstring, &log->log.oldIDstring, IDLEN);
+/**
+ * Apply the redo records to the committed values. The values and the
+ * transaction live in separate regions of the log whose flushes may reach
+ * the disk in any order, so the transaction is only left, by finishCommit,
+ * once the values are durable.
+ */
+static void commitTransaction() {
+	if (applyingCommit) return;
+	if (log->log.newSaved & 1) {
+		const struct slabRef* id = &log->log.newIDstring;
+		memcpy(&log->txData.IDstring, slabPtr(id->off), id->len);
+		log->txData.IDstring[id->len] = '\0';
 	}
-	if ((log->log.oldSaved >> 1) & 1) {
-		memcpy(&log->txData.B, &log->log.oldB, sizeof(int));
+	if ((log->log.newSaved >> 1) & 1) {
+		memcpy(&log->txData.B, &log->log.newB, sizeof(int));
 	}
-	if ((log->log.oldSaved >> 2) & 1) {
-		memcpy(&log->txData.A, &log->log.oldA, sizeof(int));
+	if ((log->log.newSaved >> 2) & 1) {
+		memcpy(&log->txData.A, &log->log.newA, sizeof(int));
 	}
+	if ((log->log.newSaved >> 3) & 1 && log->value.off != log->log.newValue.off) {
+		// not applied yet by a run that crashed before finishCommit
+		slabRetire(log->value.off);
+		log->value = log->log.newValue;
+	}
+	applyingCommit = 1;
+	resetTimers();
+	flushLog();
+	txioOnDurable(finishCommit, NULL);
+}
+
+static void abortTransaction() {
+	if (applyingCommit) return;
+	TRACE(TRACE_STATE, TR_ABORT, log->log.txID, currState(), 0);
+	// txData was never touched, dropping the redo records is enough
+	if (log->log.newSaved & 1) dropRef(&log->log.newIDstring);
+	if ((log->log.newSaved >> 3) & 1) dropRef(&log->log.newValue);
+	log->log.newSaved = 0;
+	rememberDecision(TXMSG_ABORTED);
+	notifyOutcome(TXMSG_ABORTED);
 	setWorkerState(WTX_NOTACTIVE);
-	log->log.oldSaved = 0;
-	flushAll();
 	resetTimers();
 }
 
+/**
+ * Ask the manager to abort. Before this worker has voted yes it aborts
+ * right away. Once it has, the manager may already have decided to commit,
+ * so the request is only passed on and the worker waits for the outcome
+ * like any other prepared worker.
+ */
 static void requestAbort(int crash) {
 	const managerType msg = {
 		log->log.txID,
 		crash ? TXMSG_ABORT_CRASH_REQUEST : TXMSG_ABORT_REQUEST
 	};
+	if (currState() == WTX_NOTACTIVE) {
+		printf("No transaction to abort\n");
+		return;
+	}
+	if (currState() == WTX_PREPARED || currState() == WTX_COMMITTED) {
+		// after the vote, which may still be waiting for its flush
+		sendDurableMessage(&msg);
+		return;
+	}
 	sendMessage(&msg);
 	abortTransaction();
 }
 
+/**
+ * Ask the manager to commit. Unless this worker is set to vote abort or to
+ * delay its vote, it prepares first and votes yes in the same message, so
+ * the manager need not wait for its answer to PREPARE.
+ */
 static void requestCommit(int crash) {
-	const managerType msg = {
+	managerType msg = {
 		log->log.txID,
 		crash ? TXMSG_COMMIT_CRASH_REQUEST : TXMSG_COMMIT_REQUEST
 	};
-	sendMessage(&msg);
-	// latestResponseTime = time(NULL) + RESPONSE_TIME_LIMIT;
-	// setWorkerState(WTX_PREPARED);
+	if (currState() != WTX_IN_PROGRESS) {
+		printf("No transaction in progress to commit\n");
+		return;
+	}
+	if (crash || voteValue != TXMSG_VOTE_COMMIT || delay) {
+		sendMessage(&msg);
+		return;
+	}
+	earlyVoteTid = log->log.txID;
+	log->log.numPeers = 0;
+	setWorkerState(WTX_COMMITTED);
+	msg.arg = 1;
+	sendDurableMessage(&msg);
+	rePollTime = time(NULL) + DECISION_TIME_LIMIT;
 }
 
-static void newValue(const void* src, void* logOld, void* logNew, void* realDst, int len, int bitInd) {
+/**
+ * Outside a transaction a write goes straight to txData. Inside one it only
+ * becomes a redo record in the log, which is forced when the worker
+ * prepares. The caller flushes if needed.
+ */
+static void stageValue(const void* src, void* logNew, void* realDst, int len, int bitInd) {
 	if (currState() == WTX_NOTACTIVE) {
 		memcpy(realDst, src, len);
-		flushAll();
 	} else {
-		// save old value if not already saved
-		if (!((log->log.oldSaved >> bitInd) & 1)) {
-			memcpy(logOld, realDst, len);
-			log->log.oldSaved = log->log.oldSaved | (1 << bitInd);
-		}
-		memcpy(realDst, src, len);
 		memcpy(logNew, src, len);
-		flushLog();
+		log->log.newSaved |= 1 << bitInd;
+	}
+}
+
+/**
+ * Copy len bytes into a fresh arena block and point ref at it, giving back
+ * the block ref pointed at before. Returns 0 if the arena is full.
+ */
+static int storeBytes(struct slabRef* ref, const void* src, uint32_t len) {
+	const uint32_t off = slabAlloc(len);
+	if (!off) {
+		printf("Value arena full, cannot store %u bytes\n", len);
+		return 0;
+	}
+	memcpy(slabPtr(off), src, len);
+	if (arenaDirty.hi == arenaDirty.lo || off - SLAB_BLOCK_HEADER < arenaDirty.lo) {
+		arenaDirty.lo = off - SLAB_BLOCK_HEADER;
+	}
+	if (off + len > arenaDirty.hi) arenaDirty.hi = off + len;
+	slabRetire(ref->off);
+	ref->off = off;
+	ref->len = len;
+	return 1;
+}
+
+/**
+ * Stage one write. Only string writes inside a transaction can fail, when
+ * the arena has no room for them; 0 is returned then.
+ */
+static int stageField(uint32_t field, const int32_t* value, const char* id) {
+	switch (field) {
+		case FIELD_A:
+			stageValue(value, &log->log.newA, &log->txData.A, sizeof(int), 2);
+			break;
+		case FIELD_B:
+			stageValue(value, &log->log.newB, &log->txData.B, sizeof(int), 1);
+			break;
+		case FIELD_IDSTR: {
+			const uint32_t len = strnlen(id, IDLEN - 1);
+			if (currState() == WTX_NOTACTIVE) {
+				memcpy(log->txData.IDstring, id, len);
+				log->txData.IDstring[len] = '\0';
+			} else {
+				if (!storeBytes(&log->log.newIDstring, id, len)) return 0;
+				log->log.newSaved |= 1;
+			}
+			break;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Writes are only accepted until the worker prepares; after that the redo
+ * records it voted on must not change.
+ */
+static int canWrite() {
+	switch (currState()) {
+		case WTX_NOTACTIVE:
+		case WTX_INITIATED:
+		case WTX_IN_PROGRESS:
+			return 1;
+		default:
+			printf("Cannot write in transaction %lu after it prepared\n", log->log.txID);
+			return 0;
+	}
+}
+
+static void newValue(uint32_t field, const msgType* command) {
+	if (!canWrite()) return;
+	if (stageField(field, &command->newValue, command->strData.newID) && currState() == WTX_NOTACTIVE) {
+		flushAll();
+	}
+}
+
+/**
+ * Set the variable-length value. The payload is copied once, from the
+ * receive buffer straight into the arena.
+ */
+static void newBlob(const msgType* command) {
+	if (!canWrite()) return;
+	const char* payload = (const char*) (command + 1);
+	if (currState() == WTX_NOTACTIVE) {
+		if (storeBytes(&log->value, payload, command->newValue)) flushAll();
+	} else if (storeBytes(&log->log.newValue, payload, command->newValue)) {
+		log->log.newSaved |= 1 << 3;
 	}
 }
 
-static void handleCommand(const msgType* command) {
+/**
+ * Apply every write of a NEW_BATCH with a single flush. The batch is
+ * checked up front so that it is applied completely or not at all.
+ */
+static void newBatch(const msgType* command) {
+	const uint32_t count = command->strData.batch.count;
+	if (!canWrite()) return;
+	if (count > MAX_BATCH) {
+		printf("Batch too large: %u writes\n", count);
+		return;
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		const uint32_t field = command->strData.batch.ops[i].field;
+		if (field < FIELD_A || field > FIELD_IDSTR) {
+			printf("Batch write %u has invalid field %u\n", i, field);
+			return;
+		}
+	}
+	// the string is staged first as it is the only write that can fail
+	const char* id = command->strData.batch.newID;
+	for (uint32_t i = 0; i < count; i++) {
+		if (command->strData.batch.ops[i].field == FIELD_IDSTR) {
+			if (!stageField(FIELD_IDSTR, NULL, id)) return;
+			break;
+		}
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		const uint32_t field = command->strData.batch.ops[i].field;
+		if (field != FIELD_IDSTR) stageField(field, &command->strData.batch.ops[i].value, id);
+	}
+	if (count && currState() == WTX_NOTACTIVE) flushAll();
+}
+
+/**
+ * Answer a READ straight from memory. txData only ever holds committed
+ * values, so nothing is written, flushed or asked of the manager.
+ */
+static void replyRead(const struct sockaddr_in* sender) {
+	const struct transactionData* snapshot = &log->txData;
+	static struct {
+		replyType reply;
+		char value[VALUE_MAX];
+	} packet;
+	replyType* reply = &packet.reply;
+	memset(reply, 0, sizeof(*reply));
+	reply->msgID = READ;
+	reply->tid = log->log.txID;
+	reply->txState = currState();
+	reply->A = snapshot->A;
+	reply->B = snapshot->B;
+	memcpy(reply->IDstring, snapshot->IDstring, IDLEN);
+	reply->IDstring[IDLEN - 1] = '\0';
+	reply->valueLen = log->value.len;
+	if (reply->valueLen) memcpy(packet.value, slabPtr(log->value.off), reply->valueLen);
+	txioSend(cmdSock, &packet, sizeof(*reply) + reply->valueLen, sender);
+}
+
+static void portStats(int sock, struct portStats* stats) {
+	struct txioRecvStats s;
+	txioRecvStats(sock, &s);
+	stats->received = s.received;
+	stats->dropped = s.dropped;
+	stats->depth = s.depth;
+	stats->maxDepth = s.maxDepth;
+}
+
+/**
+ * Answer a STATS with the receive queue counters of both ports.
+ */
+static void replyStats(const struct sockaddr_in* sender) {
+	statsType reply;
+	memset(&reply, 0, sizeof(reply));
+	reply.msgID = STATS;
+	portStats(cmdSock, &reply.cmdPort);
+	portStats(txSock, &reply.txPort);
+	txioSend(cmdSock, &reply, sizeof(reply), sender);
+}
+
+static void handleCommand(const msgType* command, const struct sockaddr_in* sender) {
 	if (!command) return;
 	const int msgType = command->msgID;
-	if (msgType < BEGINTX || msgType > VOTE_ABORT) {
+	if (msgType < BEGINTX || msgType > STATS || msgType == OUTCOME) {
 		printf("Received invalid command type: %d\n", msgType);
 		return;
 	}
-	printCommand(command);
+	const uint32_t tid = msgType == BEGINTX || msgType == JOINTX ? command->tid : log->log.txID;
+	TRACE(TRACE_MESSAGES, TR_COMMAND, tid, currState(), msgType);
 	switch (command->msgID) {
 		case BEGINTX:
-			initiateTransaction(command);
+			initiateTransaction(command, sender);
 			break;
 		case JOINTX:
-			initiateTransaction(command);
+			initiateTransaction(command, sender);
 			break;
 		case NEW_A:
-			newValue(&command->newValue, &log->log.oldA,
-				&log->log.newA, &log->txData.A, sizeof(int), 2);
+			newValue(FIELD_A, command);
 			break;
 		case NEW_B:
-			newValue(&command->newValue, &log->log.oldB,
-				&log->log.newB, &log->txData.B, sizeof(int), 1);
+			newValue(FIELD_B, command);
 			break;
 		case NEW_IDSTR:
-			newValue(&command->newValue, &log->log.oldIDstring, &log->log.newIDstring,
-				&log->txData.IDstring, sizeof(char) * IDLEN, 0);
+			newValue(FIELD_IDSTR, command);
+			break;
+		case NEW_BATCH:
+			newBatch(command);
+			break;
+		case NEW_VALUE:
+			newBlob(command);
 			break;
 		case DELAY_RESPONSE:
 			delay = command->delay;
 			break;
 		case CRASH:
+			TRACE(TRACE_STATE, TR_CRASH, tid, currState(), msgType);
+			traceFlush();
+			captureFlush();
 			_exit(EXIT_SUCCESS);
 			break;
 		case COMMIT:
+			if (command->notify && !watchOutcome(command, sender)) break;
 			requestCommit(0);
 			break;
 		case COMMIT_CRASH:
 			requestCommit(1);
 			break;
 		case ABORT:
+			if (command->notify && !watchOutcome(command, sender)) break;
 			requestAbort(0);
 			break;
 		case ABORT_CRASH:
@@ -395,29 +916,89 @@ static void handleCommand(const msgType* command) {
 		case VOTE_ABORT:
 			voteValue = TXMSG_VOTE_ABORT;
 			break;
+		case READ:
+			replyRead(sender);
+			break;
+		case STATS:
+			replyStats(sender);
+			break;
+	}
+}
+
+/**
+ * Tell an in-doubt peer the outcome if this worker knows it. A worker that
+ * has not voted yet aborts, so the transaction can no longer commit; one
+ * that is in doubt itself does not answer.
+ */
+static void answerDecisionRequest(const managerType* msg, const struct sockaddr_in* sender) {
+	uint32_t outcome = 0;
+	if (msg->tid == log->log.txID && currState() != WTX_NOTACTIVE) {
+		switch (currState()) {
+			case WTX_INITIATED:
+			case WTX_IN_PROGRESS:
+				requestAbort(0);
+				outcome = TXMSG_ABORTED;
+				break;
+			case WTX_ABORTED:  // voted to abort
+				outcome = TXMSG_ABORTED;
+				break;
+		}
+	} else {
+		outcome = recentDecision(msg->tid);
 	}
+	if (!outcome) return;
+	const managerType reply = { msg->tid, outcome };
+	TRACE(TRACE_MESSAGES, TR_MSG_OUT, reply.tid, currState(), reply.type);
+	txioSend(txSock, &reply, sizeof(reply), sender);
 }
 
-static void handleMessage(const managerType* msg) {
+static void handleMessage(const managerType* msg, int len, const struct sockaddr_in* sender) {
 	if (!msg) return;
-	if (msg->type < TXMSG_BEGIN || msg->type > TXMSG_ABORTED) {
+	if (msg->type < TXMSG_BEGIN || msg->type > TXMSG_LEASE_GRANT) {
 		printf("Received invalid message type: %u\n", msg->type);
 		return;
 	}
-	printMessage(msg);
-	if (msg->tid != log->log.txID) {
-		printf("Mismatching tids - expected: %lu, got: %u\n", log->log.txID, msg->tid);
+	if (msg->type == TXMSG_DECISION_REQUEST) {
+		TRACE(TRACE_MESSAGES, TR_MSG_IN, msg->tid, currState(), msg->type);
+		answerDecisionRequest(msg, sender);
 		return;
 	}
-	if (currState() == WTX_NOTACTIVE) {
-		printf("Received message when not currently active. Ignoring.\n");
+	if (msg->type == TXMSG_LEASE_GRANT) {
+		// names the first leased tid, not the transaction waiting for it
+		TRACE(TRACE_MESSAGES, TR_MSG_IN, msg->tid, currState(), msg->type);
+		leaseGranted(msg, sender);
 		return;
 	}
+	if (msg->type == TXMSG_COMMITTED && (msg->tid != log->log.txID || currState() == WTX_NOTACTIVE)
+			&& recentDecision(msg->tid) == TXMSG_COMMITTED) {
+		// our TXMSG_DONE got lost, the commit is already applied; the
+		// worker may be in another transaction by now
+		TRACE(TRACE_MESSAGES, TR_MSG_IN, msg->tid, currState(), msg->type);
+		const managerType done = { msg->tid, TXMSG_DONE };
+		sendMessage(&done);
+		return;
+	}
+	if (msg->tid != log->log.txID || currState() == WTX_NOTACTIVE) {
+		// stale or duplicate message for a transaction we are not in
+		TRACE(TRACE_MESSAGES, TR_IGNORED, msg->tid, currState(), msg->type);
+		return;
+	}
+	TRACE(TRACE_MESSAGES, TR_MSG_IN, msg->tid, currState(), msg->type);
 	switch (msg->type) {
 		case TXMSG_TID_OK:
 			if (currState() == WTX_INITIATED) {
 				latestResponseTime = 0;
+				joinedTid = msg->tid;
 				setWorkerState(WTX_IN_PROGRESS);
+				// the client may not know the tid yet
+				if (log->log.notify.sin_port) sendOutcome(msg->tid, TXMSG_TID_OK, &log->log.notify);
+			}
+			break;
+		case TXMSG_BUSY:
+			if (currState() == WTX_INITIATED) {
+				// no slot at the manager yet, ask again when it suggests
+				latestResponseTime = 0;
+				beginRetryAt = nowMs() + msg->arg;
 			}
 			break;
 		case TXMSG_TID_BAD:
@@ -432,15 +1013,38 @@ static void handleMessage(const managerType* msg) {
 				latestResponseTime = 0;
 				long waitTime = labs(delay);
 				delayedVoteValue = voteValue;
-				delayedResponseTime = time(NULL) + waitTime;
+				delayedResponseTime = nowMs() + waitTime * 1000;
 				crashAfterDelay = delay < 0;
+				if (len > sizeof(managerType)) {
+					startTree((const prepareType*) msg, sender);
+				} else {
+					tree.tid = 0;
+					log->log.numPeers = 0;
+				}
 				setWorkerState(WTX_PREPARED);
+			} else if (currState() == WTX_COMMITTED && msg->tid == earlyVoteTid
+					&& tree.tid != msg->tid && len > sizeof(managerType)) {
+				// voted with the commit request: only the participant list
+				// and, in a tree, the subtree's vote are left to do
+				const prepareType* prepare = (const prepareType*) msg;
+				startTree(prepare, sender);
+				flushLog();
+				if (prepare->fanout) {
+					tree.ownVote = TXMSG_VOTE_COMMIT;
+					reportTreeVote();
+				}
 			}
 			break;
+		case TXMSG_VOTE_COMMIT:
+		case TXMSG_VOTE_ABORT:
+			childVote(msg, sender);
+			break;
 		case TXMSG_COMMITTED:
+			forwardDecision(msg);
 			commitTransaction();
 			break;
 		case TXMSG_ABORTED:
+			// aborts are sent to every worker directly
 			abortTransaction();
 			break;
 		default:
@@ -450,19 +1054,59 @@ static void handleMessage(const managerType* msg) {
 
 static void respondVote() {
 	setWorkerState(delayedVoteValue == TXMSG_VOTE_COMMIT ? WTX_COMMITTED : WTX_ABORTED);
-	flushLog();
-	if (crashAfterDelay) _exit(EXIT_SUCCESS);
-	const managerType msg = { log->log.txID, delayedVoteValue };
-	sendMessage(&msg);
-	printf("Voted in transaction %lu: %s\n", log->log.txID, getManagerTypeString(delayedVoteValue));
+	if (crashAfterDelay) {
+		// crash only once the vote is on disk, as if the reply was lost
+		txioDrain();
+		TRACE(TRACE_STATE, TR_CRASH, log->log.txID, currState(), 0);
+		traceFlush();
+		captureFlush();
+		_exit(EXIT_SUCCESS);
+	}
+	if (tree.tid == log->log.txID) {
+		tree.ownVote = delayedVoteValue;
+		reportTreeVote();
+	} else {
+		const managerType msg = { log->log.txID, delayedVoteValue };
+		sendDurableMessage(&msg);
+	}
 	rePollTime = time(NULL) + DECISION_TIME_LIMIT;
 }
 
+/**
+ * Whether the manager is waiting on this worker: it is in the transaction
+ * and has not voted, or voted to commit. Only for a transaction joined
+ * since the last restart; a restarted worker has lost its pending vote, or
+ * its subtree's, and the manager should give up on it.
+ */
+static int awaitingOutcome() {
+	if (log->log.txID != joinedTid) return 0;
+	switch (currState()) {
+		case WTX_IN_PROGRESS:
+		case WTX_PREPARED:
+		case WTX_COMMITTED:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Tell the manager this worker is alive. Too frequent to trace.
+ */
+static void sendHeartbeat() {
+	const long long now = nowMs();
+	if (heartbeatMs <= 0 || now < nextHeartbeat || !awaitingOutcome()) return;
+	nextHeartbeat = now + heartbeatMs;
+	const managerType msg = { log->log.txID, TXMSG_HEARTBEAT };
+	txioSend(txSock, &msg, sizeof(msg), &log->log.transactionManager);
+}
+
 static void checkTimers() {
 	const time_t now = time(NULL);
+	sendHeartbeat();
 	if (latestResponseTime) {
 		if (now > latestResponseTime) {
-			printf("Response timeout for transaction %lu.\n", log->log.txID);
+			TRACE(TRACE_STATE, TR_TIMEOUT, log->log.txID, currState(), 0);
 			abortTransaction();
 			// latestResponseTime = 0;
 			// if (currState() == WTX_INITIATED) setWorkerState(WTX_NOTACTIVE);
@@ -473,18 +1117,72 @@ static void checkTimers() {
 			rePollTime = now + RESPONSE_TIME_LIMIT;
 			const managerType msg = { log->log.txID, TXMSG_POLL_RESULT };
 			sendMessage(&msg);
+			// the manager has been silent, maybe a peer knows
+			queryPeers();
 		}
 	}
+	if (beginRetryAt && nowMs() >= beginRetryAt) {
+		beginRetryAt = 0;
+		latestResponseTime = now + RESPONSE_TIME_LIMIT;
+		const managerType msg = { log->log.txID, TXMSG_BEGIN };
+		sendMessage(&msg);
+	}
 	if (delayedResponseTime) {
-		if (now > delayedResponseTime) {
+		if (nowMs() >= delayedResponseTime) {
 			delayedResponseTime = 0;
 			respondVote();
 		}
 	}
 }
 
+/**
+ * Compare the regions of the log with their checksums. A mismatch means
+ * that the last flush of the region only partly reached the disk before
+ * the machine went down. With TXIO_DURABILITY=strict, replies that depend
+ * on a flush wait for it, so nobody has acted on a torn record: a worker
+ * that was in doubt stays in doubt and asks for the outcome again, which
+ * also applies its redo records once more, and a transaction that had not
+ * prepared is aborted. In group and os mode replies go out before the
+ * flush is durable, so a vote or acknowledgement may have been sent for a
+ * record that is torn now; those modes do not promise that much.
+ */
+static void checkTornLog() {
+	// the active transaction is not flushed before PREPARE, and a worker
+	// that crashed before it aborts in any case
+	const int txFlushed = currState() != WTX_INITIATED && currState() != WTX_IN_PROGRESS;
+	const int metaTorn = log->metaChecksum != logMetaChecksum(log);
+	const int dataTorn = log->dataChecksum != logDataChecksum(log);
+	const int txTorn = txFlushed && log->txChecksum != logTxChecksum(log);
+	if (!metaTorn && !dataTorn && !txTorn) return;
+	printf("Log is torn:%s%s%s\n", metaTorn ? " metadata" : "", dataTorn ? " committed data" : "",
+		txTorn ? " transaction" : "");
+	switch (currState()) {
+		case WTX_NOTACTIVE:
+		case WTX_ABORTED:
+		case WTX_INITIATED:
+		case WTX_IN_PROGRESS:
+			// a commit only leaves the transaction once its values are
+			// durable, so these values were written outside any
+			// transaction and there are no redo records to restore them
+			if (dataTorn) {
+				printf("Committed values are torn and cannot be restored\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case WTX_PREPARED:
+		case WTX_COMMITTED:
+			if (dataTorn || txTorn) log->log.txState = WTX_PREPARED;
+			break;
+		default:
+			log->log.txState = WTX_ABORTED;
+	}
+	flushLog();
+}
+
 static void recover() {
 	if (!log->initialized) return;
+	checkTornLog();
+	TRACE(TRACE_STATE, TR_RECOVER, log->log.txID, currState(), 0);
 	switch (currState()) {
 		case WTX_NOTACTIVE:
 			break;
@@ -497,6 +1195,8 @@ static void recover() {
 			rePollTime = time(NULL) + RESPONSE_TIME_LIMIT;
 			const managerType msg = { log->log.txID, TXMSG_POLL_RESULT };
 			sendMessage(&msg);
+			// the manager may be down as well; peers that know answer at once
+			queryPeers();
 			break;
 		case WTX_INITIATED:
 		case WTX_IN_PROGRESS:
@@ -514,9 +1214,10 @@ static void printValues() {
 		struct transactionData* dat = &log->txData;
 		struct workerLog* lg = &log->log;
 		printf("txData: A=%d, B=%d, id=%s\n", dat->A, dat->B, dat->IDstring);
-		printf("Log: tid=%lu, state=%d, oldSaved:%d\n", lg->txID, lg->txState, lg->oldSaved);
-		printf("log new: A=%d, B=%d, id=%s\n", lg->newA, lg->newB, lg->newIDstring);
-		printf("log old: A=%d, B=%d, id=%s\n", lg->oldA, lg->oldB, lg->oldIDstring);
+		printf("Log: tid=%lu, state=%d, newSaved:%d\n", lg->txID, lg->txState, lg->newSaved);
+		printf("value: %u bytes\n", log->value.len);
+		printf("log new: A=%d, B=%d, id %u bytes, value %u bytes\n", lg->newA, lg->newB,
+			lg->newIDstring.len, lg->newValue.len);
 	}
 }
 
@@ -525,8 +1226,12 @@ int main(int argc, char **argv) {
 	printValues();
 	recover();
 	while (1) {
-		handleCommand(receiveCommand());
-		handleMessage(receiveMessage());
+		struct sockaddr_in sender;
+		handleCommand(receiveCommand(&sender), &sender);
+		int len = 0;
+		const managerType* msg = receiveMessage(&sender, &len);
+		handleMessage(msg, len, &sender);
 		checkTimers();
+		txioPoll();
 	}
 }
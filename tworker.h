@@ -1,12 +1,22 @@
 #ifndef TWORKER_H
 #define TWORKER_H 1
+#include <stdint.h>
 #include <sys/time.h>
 #include <netinet/in.h>
+#include <stddef.h>
+
+#include "checksum.h"
+#include "slab.h"
 
 #define MAX_NODES 10
 #define IDLEN 64
+#define VALUE_MAX 16384  // longest variable-length value
+#define MAX_PARTICIPANTS 4096  // workers in one transaction
+#define RECENT_DECISIONS 8
 #define RESPONSE_TIME_LIMIT 10
 #define DECISION_TIME_LIMIT 30
+#define HEARTBEAT_MS 100  // between heartbeats to the manager
+#define LEASE_SIZE 64     // tids asked for at a time
 // Feel free to modify anything in this file except the
 // struct transactionData
 
@@ -16,7 +26,7 @@ enum workerTxState {
     WTX_PREPARED,
     WTX_COMMITTED,
     /*---added---*/
-    // make sure to update getManagerTypeString()
+    // make sure to update traceStateName()
     WTX_INITIATED,
     WTX_IN_PROGRESS
 };
@@ -27,26 +37,115 @@ struct transactionData {
     int B;
 };
 
+struct peerAddr {
+    uint32_t addr;  // network byte order
+    uint16_t port;  // network byte order
+    uint16_t pad;
+};
+
+// Writes of the active transaction are redo records only: txData always
+// holds committed values and is updated when the outcome is COMMITTED.
+// Nothing here has to be durable before PREPARE, since a worker that
+// crashes earlier aborts. Strings are kept in the value arena.
 struct workerLog {
     unsigned long txID;
     enum workerTxState txState;
     struct sockaddr_in transactionManager;
-    unsigned int oldSaved;  // use this to record if
-                            // the old values of A, B and IDstring have been
-                            // captured. Associated a different bit
-                            // with each variable;
-    int oldA;
-    int oldB;
-    char oldIDstring[IDLEN];
+    unsigned int newSaved;  // one bit per variable written by the
+                            // transaction: IDstring 0, B 1, A 2, value 3
     int newA;
     int newB;
-    char newIDstring[IDLEN];
+    struct slabRef newIDstring;
+    struct slabRef newValue;
+    struct sockaddr_in notify;  // client waiting for the outcome, port 0 if none
+    // Participants as listed in PREPARE, this worker at selfIndex. Logged
+    // with the PREPARED state so that an in-doubt worker can ask the others
+    // for the outcome, even after a restart.
+    uint32_t numPeers;
+    uint32_t selfIndex;
+    uint32_t fanout;
+    struct peerAddr peers[MAX_PARTICIPANTS];
 };
 
+// Outcome of a transaction this worker took part in, kept so that it can
+// tell peers that are still in doubt.
+struct recentDecision {
+    uint32_t tid;
+    uint32_t outcome;  // TXMSG_COMMITTED or TXMSG_ABORTED
+};
+
+#define LOG_PAGE 4096  // regions of the log start on their own page
+
+// The log file holds three regions, each starting on a page of its own so
+// that a flush only writes back the regions it changed:
+//   metadata   whether the log is set up, the arena header and the recent
+//              decisions
+//   data       the committed values
+//   tx         the active transaction
+// and then, at LOG_ARENA_OFFSET, the arena holding variable-length values.
+// Each region carries a checksum of itself as of the last flush. Regions
+// are as large as their structures, so they move when a record grows.
 struct logFile {
     int initialized;
-    struct transactionData txData;
+    struct slabArena arena;
+    struct recentDecision recent[RECENT_DECISIONS];
+    uint32_t recentNext;  // ring position of the next decision
+    uint32_t metaChecksum;
+
+    struct transactionData txData __attribute__((aligned(LOG_PAGE)));
+    struct slabRef value;  // committed variable-length value
+    uint32_t dataChecksum;
+
+    uint32_t txChecksum __attribute__((aligned(LOG_PAGE)));
     struct workerLog log;
 };
 
+#define LOG_META_OFFSET 0
+#define LOG_DATA_OFFSET offsetof(struct logFile, txData)
+#define LOG_TX_OFFSET offsetof(struct logFile, txChecksum)
+#define LOG_ARENA_OFFSET sizeof(struct logFile)
+#define LOG_ARENA_SIZE (256 * 1024)
+#define LOG_FILE_SIZE (LOG_ARENA_OFFSET + LOG_ARENA_SIZE)
+
+// Bytes of each region in use, from its offset: the tx region ends after
+// the peers of the active transaction.
+#define LOG_META_LEN (LOG_DATA_OFFSET - LOG_META_OFFSET)
+#define LOG_DATA_LEN (LOG_TX_OFFSET - LOG_DATA_OFFSET)
+static inline size_t logUsedLen(const struct workerLog* lg) {
+    const uint32_t numPeers = lg->numPeers < MAX_PARTICIPANTS ? lg->numPeers : MAX_PARTICIPANTS;
+    return offsetof(struct workerLog, peers) + numPeers * sizeof(struct peerAddr);
+}
+static inline size_t logTxLen(const struct logFile* log) {
+    return offsetof(struct logFile, log) - LOG_TX_OFFSET + logUsedLen(&log->log);
+}
+
+static inline uint32_t refChecksum(uint32_t crc, const struct logFile* log, struct slabRef ref) {
+    crc = checksum(crc, &ref, sizeof(ref));
+    if (ref.off && ref.off + (uint64_t) ref.len <= LOG_ARENA_SIZE) {
+        crc = checksum(crc, (const char*) log + LOG_ARENA_OFFSET + ref.off, ref.len);
+    }
+    return crc;
+}
+
+// The arena header is left out: it changes with every allocation, and
+// flushes write it whenever they write a new value.
+static inline uint32_t logMetaChecksum(const struct logFile* log) {
+    uint32_t crc = checksum(0, &log->initialized, sizeof(log->initialized));
+    crc = checksum(crc, log->recent, sizeof(log->recent));
+    return checksum(crc, &log->recentNext, sizeof(log->recentNext));
+}
+
+static inline uint32_t logDataChecksum(const struct logFile* log) {
+    const uint32_t crc = checksum(0, &log->txData, sizeof(log->txData));
+    return refChecksum(crc, log, log->value);
+}
+
+// Covers the peers in use and the values of the redo records.
+static inline uint32_t logTxChecksum(const struct logFile* log) {
+    uint32_t crc = checksum(0, &log->log, logUsedLen(&log->log));
+    if (log->log.newSaved & 1) crc = refChecksum(crc, log, log->log.newIDstring);
+    if (log->log.newSaved & 8) crc = refChecksum(crc, log, log->log.newValue);
+    return crc;
+}
+
 #endif /* TWORKER_H */
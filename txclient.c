@@ -0,0 +1,394 @@
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "txclient.h"
+
+enum opKind {
+	OP_OUTCOME,  // completed by an outcomeType
+	OP_READ      // completed by a replyType
+};
+
+struct txcOp {
+	struct txcOp* next;
+	struct txcClient* client;  // NULL once unlinked
+	enum opKind kind;
+	struct sockaddr_in worker;
+	uint32_t tid;  // 0: whatever transaction the worker is in
+	enum txcStatus status;
+	double submitted;
+	double completed;
+	double deadline;
+	txcCallback cb;
+	void* arg;
+	replyType* reply;  // OP_READ, followed by the value
+};
+
+struct txcClient {
+	int sock;
+	int timeoutMs;
+	struct txcOp* ops;  // pending, oldest first
+	struct txcOp* opsTail;
+	struct txcOp* done;  // completed, callbacks not run yet
+	struct txcOp* doneTail;
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+struct txcClient* txcOpen() {
+	struct txcClient* c = calloc(1, sizeof(*c));
+	if (!c) return NULL;
+	c->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (c->sock < 0) {
+		free(c);
+		return NULL;
+	}
+	c->timeoutMs = TXC_DEFAULT_TIMEOUT_MS;
+	return c;
+}
+
+static void freeOp(struct txcOp* op) {
+	free(op->reply);
+	free(op);
+}
+
+static void dropAll(struct txcOp* list) {
+	while (list) {
+		struct txcOp* op = list;
+		list = op->next;
+		// handles the caller still holds stay valid until txcRelease
+		op->client = NULL;
+		if (op->cb) freeOp(op);
+	}
+}
+
+void txcClose(struct txcClient* c) {
+	dropAll(c->ops);
+	dropAll(c->done);
+	close(c->sock);
+	free(c);
+}
+
+int txcFD(const struct txcClient* c) {
+	return c->sock;
+}
+
+void txcSetTimeout(struct txcClient* c, int ms) {
+	c->timeoutMs = ms;
+}
+
+int txcResolve(const char* host, unsigned port, struct sockaddr_in* addr) {
+	struct addrinfo hints, *info;
+	char service[16];
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	snprintf(service, sizeof(service), "%u", port);
+	if (getaddrinfo(host, service, &hints, &info)) return -1;
+	*addr = *(struct sockaddr_in*) info->ai_addr;
+	freeaddrinfo(info);
+	return 0;
+}
+
+static int sendCommand(struct txcClient* c, const struct sockaddr_in* worker, const void* msg,
+		int len) {
+	int n = sendto(c->sock, msg, len, 0, (const struct sockaddr*) worker, sizeof(*worker));
+	return n == len ? 0 : -1;
+}
+
+static void initCommand(msgType* msg, uint32_t kind) {
+	memset(msg, 0, sizeof(*msg));
+	msg->msgID = kind;
+}
+
+static void unlinkOp(struct txcClient* c, struct txcOp* op) {
+	struct txcOp* prev = NULL;
+	for (struct txcOp* o = c->ops; o; prev = o, o = o->next) {
+		if (o != op) continue;
+		if (prev) prev->next = op->next;
+		else c->ops = op->next;
+		if (c->opsTail == op) c->opsTail = prev;
+		return;
+	}
+}
+
+static void complete(struct txcClient* c, struct txcOp* op, enum txcStatus status) {
+	unlinkOp(c, op);
+	op->status = status;
+	op->completed = now();
+	op->next = NULL;
+	if (c->doneTail) c->doneTail->next = op;
+	else c->done = op;
+	c->doneTail = op;
+}
+
+/**
+ * Send msg and start tracking an operation that waits for its answer. A
+ * send that fails completes the operation with TXC_FAILED right away.
+ */
+static struct txcOp* submit(struct txcClient* c, enum opKind kind,
+		const struct sockaddr_in* worker, uint32_t tid, const void* msg, int len,
+		txcCallback cb, void* arg) {
+	struct txcOp* op = calloc(1, sizeof(*op));
+	if (!op) return NULL;
+	op->client = c;
+	op->kind = kind;
+	op->worker = *worker;
+	op->tid = tid;
+	op->cb = cb;
+	op->arg = arg;
+	op->submitted = now();
+	op->deadline = op->submitted + c->timeoutMs;
+	if (c->opsTail) c->opsTail->next = op;
+	else c->ops = op;
+	c->opsTail = op;
+	if (sendCommand(c, worker, msg, len)) complete(c, op, TXC_FAILED);
+	return op;
+}
+
+static struct txcOp* initiate(struct txcClient* c, uint32_t kind, const struct sockaddr_in* worker,
+		const char* managerHost, unsigned managerPort, uint32_t tid, txcCallback cb, void* arg) {
+	msgType msg;
+	initCommand(&msg, kind);
+	msg.tid = tid;
+	msg.port = managerPort;
+	msg.notify = 1;
+	strncpy(msg.strData.hostName, managerHost, HOSTLEN - 1);
+	return submit(c, OP_OUTCOME, worker, tid, &msg, sizeof(msg), cb, arg);
+}
+
+struct txcOp* txcBegin(struct txcClient* c, const struct sockaddr_in* worker,
+		const char* managerHost, unsigned managerPort, uint32_t tid, txcCallback cb, void* arg) {
+	return initiate(c, BEGINTX, worker, managerHost, managerPort, tid, cb, arg);
+}
+
+struct txcOp* txcJoin(struct txcClient* c, const struct sockaddr_in* worker,
+		const char* managerHost, unsigned managerPort, uint32_t tid, txcCallback cb, void* arg) {
+	return initiate(c, JOINTX, worker, managerHost, managerPort, tid, cb, arg);
+}
+
+static struct txcOp* finish(struct txcClient* c, uint32_t kind, const struct sockaddr_in* worker,
+		uint32_t tid, txcCallback cb, void* arg) {
+	msgType msg;
+	initCommand(&msg, kind);
+	msg.tid = tid;
+	msg.notify = 1;
+	return submit(c, OP_OUTCOME, worker, tid, &msg, sizeof(msg), cb, arg);
+}
+
+struct txcOp* txcCommit(struct txcClient* c, const struct sockaddr_in* worker, uint32_t tid,
+		txcCallback cb, void* arg) {
+	return finish(c, COMMIT, worker, tid, cb, arg);
+}
+
+struct txcOp* txcAbort(struct txcClient* c, const struct sockaddr_in* worker, uint32_t tid,
+		txcCallback cb, void* arg) {
+	return finish(c, ABORT, worker, tid, cb, arg);
+}
+
+struct txcOp* txcRead(struct txcClient* c, const struct sockaddr_in* worker, txcCallback cb,
+		void* arg) {
+	msgType msg;
+	initCommand(&msg, READ);
+	return submit(c, OP_READ, worker, 0, &msg, sizeof(msg), cb, arg);
+}
+
+static int setField(struct txcClient* c, const struct sockaddr_in* worker, uint32_t kind,
+		int32_t value) {
+	msgType msg;
+	initCommand(&msg, kind);
+	msg.newValue = value;
+	return sendCommand(c, worker, &msg, sizeof(msg));
+}
+
+int txcSetA(struct txcClient* c, const struct sockaddr_in* worker, int32_t value) {
+	return setField(c, worker, NEW_A, value);
+}
+
+int txcSetB(struct txcClient* c, const struct sockaddr_in* worker, int32_t value) {
+	return setField(c, worker, NEW_B, value);
+}
+
+int txcSetID(struct txcClient* c, const struct sockaddr_in* worker, const char* id) {
+	msgType msg;
+	initCommand(&msg, NEW_IDSTR);
+	strncpy(msg.strData.newID, id, IDLEN - 1);
+	return sendCommand(c, worker, &msg, sizeof(msg));
+}
+
+int txcSetValue(struct txcClient* c, const struct sockaddr_in* worker, const void* value,
+		uint32_t len) {
+	if (len > VALUE_MAX) return -1;
+	char* packet = malloc(sizeof(msgType) + len);
+	if (!packet) return -1;
+	msgType* msg = (msgType*) packet;
+	initCommand(msg, NEW_VALUE);
+	msg->newValue = len;
+	memcpy(packet + sizeof(msgType), value, len);
+	int res = sendCommand(c, worker, packet, sizeof(msgType) + len);
+	free(packet);
+	return res;
+}
+
+static int sameWorker(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static enum txcStatus outcomeStatus(uint32_t outcome) {
+	switch (outcome) {
+		case TXMSG_COMMITTED:
+			return TXC_COMMITTED;
+		case TXMSG_ABORTED:
+			return TXC_ABORTED;
+		case TXMSG_TID_BAD:
+			return TXC_REFUSED;
+		default:
+			return TXC_UNKNOWN;
+	}
+}
+
+/**
+ * Match one datagram from a worker against the pending operations. An
+ * outcome completes everything waiting on that worker's transaction, a
+ * read reply the oldest read of that worker.
+ */
+static void handleReply(struct txcClient* c, const char* buf, int len,
+		const struct sockaddr_in* from) {
+	if (len == sizeof(outcomeType) && ((const outcomeType*) buf)->msgID == OUTCOME) {
+		const outcomeType* o = (const outcomeType*) buf;
+		struct txcOp* next;
+		for (struct txcOp* op = c->ops; op; op = next) {
+			next = op->next;
+			if (op->kind == OP_OUTCOME && sameWorker(&op->worker, from)
+					&& (!op->tid || op->tid == o->tid)) {
+				op->tid = o->tid;
+				// a started transaction has no outcome yet
+				if (o->outcome != TXMSG_TID_OK) complete(c, op, outcomeStatus(o->outcome));
+			}
+		}
+		return;
+	}
+	const replyType* r = (const replyType*) buf;
+	if (len < (int) sizeof(replyType) || r->msgID != READ || len != sizeof(replyType) + r->valueLen) {
+		return;
+	}
+	for (struct txcOp* op = c->ops; op; op = op->next) {
+		if (op->kind != OP_READ || !sameWorker(&op->worker, from)) continue;
+		op->reply = malloc(len);
+		if (!op->reply) {
+			complete(c, op, TXC_FAILED);
+			return;
+		}
+		memcpy(op->reply, buf, len);
+		op->tid = r->tid;
+		complete(c, op, TXC_READ);
+		return;
+	}
+}
+
+int txcPoll(struct txcClient* c, int timeoutMs) {
+	static char buf[sizeof(replyType) + VALUE_MAX];
+	struct pollfd pfd = { c->sock, POLLIN, 0 };
+	if (poll(&pfd, 1, timeoutMs) > 0) {
+		while (1) {
+			struct sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+			int n = recvfrom(c->sock, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*) &from,
+				&fromLen);
+			if (n < 0) break;
+			handleReply(c, buf, n, &from);
+		}
+	}
+
+	const double t = now();
+	struct txcOp* next;
+	for (struct txcOp* op = c->ops; op; op = next) {
+		next = op->next;
+		if (t >= op->deadline) complete(c, op, TXC_TIMEOUT);
+	}
+
+	// callbacks may submit new operations, so the list is taken first
+	int completed = 0;
+	struct txcOp* done = c->done;
+	c->done = c->doneTail = NULL;
+	for (struct txcOp* op = done; op; op = next) {
+		next = op->next;
+		op->next = NULL;
+		op->client = NULL;
+		completed++;
+		if (op->cb) {
+			op->cb(op, op->arg);
+			freeOp(op);
+		}
+	}
+	return completed;
+}
+
+enum txcStatus txcWait(struct txcClient* c, struct txcOp* op) {
+	while (op->status == TXC_PENDING) {
+		int left = (int) (op->deadline - now()) + 1;
+		txcPoll(c, left > 0 ? left : 0);
+	}
+	return op->status;
+}
+
+enum txcStatus txcStatus(const struct txcOp* op) {
+	return op->status;
+}
+
+double txcLatency(const struct txcOp* op) {
+	return (op->status == TXC_PENDING ? now() : op->completed) - op->submitted;
+}
+
+uint32_t txcTid(const struct txcOp* op) {
+	return op->tid;
+}
+
+const replyType* txcReadReply(const struct txcOp* op) {
+	return op->reply;
+}
+
+void txcRelease(struct txcOp* op) {
+	if (op->client) {
+		struct txcClient* c = op->client;
+		if (op->status == TXC_PENDING) {
+			unlinkOp(c, op);
+		} else {
+			// completed but not yet handed out by txcPoll
+			struct txcOp* prev = NULL;
+			for (struct txcOp* o = c->done; o; prev = o, o = o->next) {
+				if (o != op) continue;
+				if (prev) prev->next = op->next;
+				else c->done = op->next;
+				if (c->doneTail == op) c->doneTail = prev;
+				break;
+			}
+		}
+	}
+	freeOp(op);
+}
+
+const char* txcStatusName(enum txcStatus status) {
+	static const char* names[] = {
+		"pending",
+		"committed",
+		"aborted",
+		"refused",
+		"unknown",
+		"read",
+		"timed out",
+		"send failed"
+	};
+	if (status < TXC_PENDING || status > TXC_FAILED) return "?";
+	return names[status];
+}
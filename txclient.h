@@ -0,0 +1,138 @@
+#ifndef TXCLIENT_H
+#define TXCLIENT_H 1
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "msg.h"
+
+// Client library for driving workers from an application instead of one
+// cmd process per operation. A client owns one UDP socket; any number of
+// operations on any number of workers can be outstanding on it at a time.
+//
+// Writes (txcSetA and friends) are fire-and-forget like the cmd commands.
+// Begin, join, commit and abort complete with the final outcome of the
+// worker's transaction, and read with the worker's committed values.
+// Completion is reported either through a callback, after which the
+// operation is freed, or by polling the handle with txcStatus until it is
+// no longer TXC_PENDING and freeing it with txcRelease.
+//
+// Nothing happens in the background: replies are only picked up, and
+// callbacks only run, inside txcPoll and txcWait. A client must not be used
+// from more than one thread at a time.
+
+enum txcStatus {
+	TXC_PENDING = 0,
+	TXC_COMMITTED,
+	TXC_ABORTED,
+	TXC_REFUSED,  // BEGIN/JOIN: the worker was in another transaction
+	TXC_UNKNOWN,  // the worker no longer remembers the transaction
+	TXC_READ,     // read completed, see txcReadReply
+	TXC_TIMEOUT,
+	TXC_FAILED    // could not be sent
+};
+
+#define TXC_DEFAULT_TIMEOUT_MS 60000
+
+struct txcClient;
+struct txcOp;
+
+typedef void (*txcCallback)(struct txcOp* op, void* arg);
+
+/**
+ * Open a client on an ephemeral port. Returns NULL if no socket could be
+ * set up.
+ */
+struct txcClient* txcOpen(void);
+
+/**
+ * Close the client. Outstanding operations are dropped without their
+ * callbacks running.
+ */
+void txcClose(struct txcClient* c);
+
+/**
+ * The client's socket, for waiting on it with poll/select alongside other
+ * descriptors. Call txcPoll(c, 0) when it is readable.
+ */
+int txcFD(const struct txcClient* c);
+
+/**
+ * Operations not complete after ms milliseconds end with TXC_TIMEOUT.
+ * Applies to operations submitted afterwards.
+ */
+void txcSetTimeout(struct txcClient* c, int ms);
+
+/**
+ * Look up a worker's (or manager's) host and port.
+ */
+int txcResolve(const char* host, unsigned port, struct sockaddr_in* addr);
+
+/**
+ * Have worker begin (or join) transaction tid coordinated by the manager at
+ * managerHost:managerPort. Completes when the transaction has ended on
+ * that worker. A BEGIN with tid 0 gets a tid from the manager; txcTid
+ * returns it once the transaction has started.
+ */
+struct txcOp* txcBegin(struct txcClient* c, const struct sockaddr_in* worker,
+	const char* managerHost, unsigned managerPort, uint32_t tid, txcCallback cb, void* arg);
+struct txcOp* txcJoin(struct txcClient* c, const struct sockaddr_in* worker,
+	const char* managerHost, unsigned managerPort, uint32_t tid, txcCallback cb, void* arg);
+
+/**
+ * Ask worker to commit (or abort) transaction tid, 0 for whichever it is
+ * in. Completes with the outcome.
+ */
+struct txcOp* txcCommit(struct txcClient* c, const struct sockaddr_in* worker, uint32_t tid,
+	txcCallback cb, void* arg);
+struct txcOp* txcAbort(struct txcClient* c, const struct sockaddr_in* worker, uint32_t tid,
+	txcCallback cb, void* arg);
+
+/**
+ * Read the worker's committed values.
+ */
+struct txcOp* txcRead(struct txcClient* c, const struct sockaddr_in* worker, txcCallback cb,
+	void* arg);
+
+int txcSetA(struct txcClient* c, const struct sockaddr_in* worker, int32_t value);
+int txcSetB(struct txcClient* c, const struct sockaddr_in* worker, int32_t value);
+int txcSetID(struct txcClient* c, const struct sockaddr_in* worker, const char* id);
+int txcSetValue(struct txcClient* c, const struct sockaddr_in* worker, const void* value,
+	uint32_t len);
+
+/**
+ * Pick up replies, waiting up to timeoutMs for the first one (-1 for no
+ * limit), then expire overdue operations and run the callbacks of
+ * everything that completed. Returns the number of operations completed.
+ */
+int txcPoll(struct txcClient* c, int timeoutMs);
+
+/**
+ * Poll until op has completed and return its status. Only for operations
+ * submitted without a callback.
+ */
+enum txcStatus txcWait(struct txcClient* c, struct txcOp* op);
+
+enum txcStatus txcStatus(const struct txcOp* op);
+
+/**
+ * Milliseconds from submission to completion, or so far if still pending.
+ */
+double txcLatency(const struct txcOp* op);
+
+uint32_t txcTid(const struct txcOp* op);
+
+/**
+ * The reply of a completed read; valueLen bytes of the value follow it.
+ * NULL for other operations.
+ */
+const replyType* txcReadReply(const struct txcOp* op);
+
+/**
+ * Free an operation submitted without a callback. A pending one is
+ * cancelled.
+ */
+void txcRelease(struct txcOp* op);
+
+const char* txcStatusName(enum txcStatus status);
+
+#endif /* TXCLIENT_H */
@@ -0,0 +1,846 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "shmring.h"
+#include "txio.h"
+
+#if defined(__linux__) && !defined(TXIO_NO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TXIO_HAVE_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#define MAX_WATCHED 4
+#define LOG_QUEUE_LEN 256
+#define RECV_QUEUE_SIZE (1024 * 1024)  // bytes per receive queue, power of two
+#define RECV_WRAP 0xffffffffu          // record length that sends the reader back to the start
+#define RECEIVER_POLL_MS 100           // how soon the receive thread sees a new socket
+
+static enum txioBackend backend = TXIO_SYNC;
+static enum txioLogMode logMode = TXIO_LOG_INLINE;
+static enum txioDurability durability = TXIO_DURABLE_STRICT;
+static int logFD = -1;
+static void* logBase;
+static size_t logLen;
+
+// Every flush gets a sequence number; durableSeq is the highest one known
+// to be on disk. Callbacks queued with txioOnDurable wait for their number.
+// durableSeq is written by the log writer thread when there is one.
+static uint64_t flushSeq = 0;
+static uint64_t durableSeq = 0;
+
+// With group durability, flushes only widen the open group; it is synced as
+// a whole once groupMs have passed since its first flush or groupRecords
+// flushes have joined it.
+static int groupMs = TXIO_GROUP_MS;
+static int groupRecords = TXIO_GROUP_RECORDS;
+static struct {
+	size_t lo, hi;  // byte range of the mapping to sync
+	int records;    // 0 if no group is open
+	long long start;  // ms
+} group;
+
+struct pending {
+	struct pending* next;
+	uint64_t seq;
+	void (*fn)(void*);
+	void* arg;
+};
+
+static struct pending* pendingHead;
+static struct pending* pendingTail;
+
+struct durableSend {
+	int sock;
+	int len;
+	struct sockaddr_in to;
+	char data[];
+};
+
+// A log record names a range of the mapping that must reach the disk. The
+// network thread is the only producer and the writer thread the only
+// consumer, so head and tail are each written by one side only.
+struct logRecord {
+	uint64_t seq;
+	size_t off;
+	size_t len;
+};
+
+static struct {
+	struct logRecord records[LOG_QUEUE_LEN];
+	uint64_t head;
+	uint64_t tail;
+} logQueue;
+
+static sem_t logWork;
+static pthread_t logWriter;
+
+static uint64_t getDurableSeq() {
+	return __atomic_load_n(&durableSeq, __ATOMIC_ACQUIRE);
+}
+
+static void setDurableSeq(uint64_t seq) {
+	__atomic_store_n(&durableSeq, seq, __ATOMIC_RELEASE);
+}
+
+static long long nowMs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void syncRange(size_t off, size_t len) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = off & ~(page - 1);
+	if (msync((char*) logBase + start, len + off - start, MS_SYNC | MS_INVALIDATE)) {
+		perror("Msync problem");
+		exit(-1);
+	}
+}
+
+static int byOffset(const void* a, const void* b) {
+	const struct logRecord* x = a;
+	const struct logRecord* y = b;
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+/**
+ * Log writer thread: takes every record queued since its last pass and
+ * syncs each stretch of the mapping they cover once, records that overlap
+ * or touch the same page merged, then publishes the newest sequence number.
+ * Pages between records that are far apart are left alone.
+ */
+static void* logWriterMain(void* arg) {
+	static struct logRecord batch[LOG_QUEUE_LEN];
+	const size_t page = sysconf(_SC_PAGESIZE);
+	while (1) {
+		if (sem_wait(&logWork)) continue;
+		uint64_t head = logQueue.head;
+		uint64_t tail = __atomic_load_n(&logQueue.tail, __ATOMIC_ACQUIRE);
+		if (head == tail) continue;
+
+		int n = 0;
+		uint64_t seq = 0;
+		for (; head != tail; head++) {
+			batch[n] = logQueue.records[head % LOG_QUEUE_LEN];
+			seq = batch[n++].seq;
+		}
+		__atomic_store_n(&logQueue.head, head, __ATOMIC_RELEASE);
+		qsort(batch, n, sizeof(batch[0]), byOffset);
+		size_t lo = batch[0].off, hi = batch[0].off + batch[0].len;
+		for (int i = 1; i < n; i++) {
+			if (batch[i].off <= ((hi + page - 1) & ~(page - 1))) {
+				if (batch[i].off + batch[i].len > hi) hi = batch[i].off + batch[i].len;
+				continue;
+			}
+			syncRange(lo, hi - lo);
+			lo = batch[i].off;
+			hi = batch[i].off + batch[i].len;
+		}
+		syncRange(lo, hi - lo);
+		setDurableSeq(seq);
+	}
+	return NULL;
+}
+
+static void startLogWriter() {
+	if (sem_init(&logWork, 0, 0) || pthread_create(&logWriter, NULL, logWriterMain, NULL)) {
+		perror("Starting log writer");
+		exit(-1);
+	}
+}
+
+static void enqueueLogRecord(size_t off, size_t len) {
+	uint64_t tail = logQueue.tail;
+	// The writer frees slots as soon as it picks records up, so this only
+	// waits when more than LOG_QUEUE_LEN flushes pile up behind one sync.
+	while (tail - __atomic_load_n(&logQueue.head, __ATOMIC_ACQUIRE) >= LOG_QUEUE_LEN) {
+		sched_yield();
+	}
+	struct logRecord* rec = &logQueue.records[tail % LOG_QUEUE_LEN];
+	rec->seq = flushSeq;
+	rec->off = off;
+	rec->len = len;
+	__atomic_store_n(&logQueue.tail, tail + 1, __ATOMIC_RELEASE);
+	sem_post(&logWork);
+}
+
+// With a receive thread, every watched socket gets a queue that the thread
+// fills and txioRecv empties: a single-producer/single-consumer ring of
+// records, each 8-byte aligned. head and tail are byte positions that only
+// ever grow; each is written by one side only, and they live on separate
+// cache lines, as do the producer's and the consumer's counters.
+struct recvRecord {
+	uint32_t len;     // as received, may be more than was kept
+	uint32_t stored;  // bytes that follow
+	struct sockaddr_in from;
+};
+
+struct recvQueue {
+	int sock;
+	char* data;
+	char pad0[48];
+	uint64_t tail;      // written by the receive thread
+	uint64_t received;  // datagrams queued
+	uint64_t dropped;   // datagrams that found the queue full
+	uint32_t maxDepth;
+	char pad1[36];
+	uint64_t head;      // written by txioRecv
+	uint64_t taken;     // datagrams taken out
+	char pad2[48];
+};
+
+static int receiveThread;
+static struct recvQueue recvQueues[MAX_WATCHED];
+static int numRecvQueues;  // published with release once a queue is set up
+static pthread_t receiver;
+
+static uint32_t recvSpace(uint32_t stored) {
+	return sizeof(struct recvRecord) + ((stored + 7) & ~7u);
+}
+
+static void pushDatagram(struct recvQueue* q, const void* buf, uint32_t len, uint32_t stored,
+		const struct sockaddr_in* from) {
+	const uint32_t need = recvSpace(stored);
+	uint64_t tail = q->tail;
+	const uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+	const uint32_t pos = tail & (RECV_QUEUE_SIZE - 1);
+	const uint32_t skip = pos + need > RECV_QUEUE_SIZE ? RECV_QUEUE_SIZE - pos : 0;
+	if (tail + skip + need - head > RECV_QUEUE_SIZE) {
+		__atomic_store_n(&q->dropped, q->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (skip) {
+		((struct recvRecord*) (q->data + pos))->len = RECV_WRAP;
+		tail += skip;
+	}
+	struct recvRecord* rec = (struct recvRecord*) (q->data + (tail & (RECV_QUEUE_SIZE - 1)));
+	rec->len = len;
+	rec->stored = stored;
+	rec->from = *from;
+	memcpy(rec + 1, buf, stored);
+	__atomic_store_n(&q->tail, tail + need, __ATOMIC_RELEASE);
+
+	const uint64_t received = q->received + 1;
+	__atomic_store_n(&q->received, received, __ATOMIC_RELAXED);
+	const uint32_t depth = received - __atomic_load_n(&q->taken, __ATOMIC_RELAXED);
+	if (depth > q->maxDepth) __atomic_store_n(&q->maxDepth, depth, __ATOMIC_RELAXED);
+}
+
+static int popDatagram(struct recvQueue* q, void* buf, int buflen, struct sockaddr_in* from) {
+	uint64_t head = q->head;
+	const uint64_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+	if (head == tail) return -1;
+	struct recvRecord* rec = (struct recvRecord*) (q->data + (head & (RECV_QUEUE_SIZE - 1)));
+	if (rec->len == RECV_WRAP) {
+		head += RECV_QUEUE_SIZE - (head & (RECV_QUEUE_SIZE - 1));
+		rec = (struct recvRecord*) q->data;
+	}
+	const int n = rec->len;
+	memcpy(buf, rec + 1, rec->stored < (uint32_t) buflen ? rec->stored : (uint32_t) buflen);
+	if (from) *from = rec->from;
+	__atomic_store_n(&q->head, head + recvSpace(rec->stored), __ATOMIC_RELEASE);
+	__atomic_store_n(&q->taken, q->taken + 1, __ATOMIC_RELAXED);
+	return n;
+}
+
+/**
+ * Receive thread: waits for any watched socket to become readable and
+ * moves everything it has into the socket's queue.
+ */
+static void* receiverMain(void* arg) {
+	char* buf = malloc(TXIO_MAX_DATAGRAM);
+	struct pollfd fds[MAX_WATCHED];
+	if (!buf) {
+		perror("Allocating receive buffer");
+		exit(-1);
+	}
+	while (1) {
+		const int n = __atomic_load_n(&numRecvQueues, __ATOMIC_ACQUIRE);
+		for (int i = 0; i < n; i++) {
+			fds[i].fd = recvQueues[i].sock;
+			fds[i].events = POLLIN;
+		}
+		if (poll(fds, n, RECEIVER_POLL_MS) <= 0) continue;
+		for (int i = 0; i < n; i++) {
+			if (!(fds[i].revents & POLLIN)) continue;
+			struct sockaddr_in from;
+			socklen_t addrLen = sizeof(from);
+			int len;
+			while ((len = recvfrom(fds[i].fd, buf, TXIO_MAX_DATAGRAM, MSG_DONTWAIT | MSG_TRUNC,
+					(struct sockaddr*) &from, &addrLen)) >= 0) {
+				pushDatagram(&recvQueues[i], buf, len, len < TXIO_MAX_DATAGRAM ? len : TXIO_MAX_DATAGRAM,
+					&from);
+				addrLen = sizeof(from);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void addRecvQueue(int sock) {
+	if (numRecvQueues == MAX_WATCHED) {
+		printf("Too many sockets for the receive thread\n");
+		exit(-1);
+	}
+	struct recvQueue* q = &recvQueues[numRecvQueues];
+	q->sock = sock;
+	q->data = malloc(RECV_QUEUE_SIZE);
+	if (!q->data) {
+		perror("Allocating receive queue");
+		exit(-1);
+	}
+	__atomic_store_n(&numRecvQueues, numRecvQueues + 1, __ATOMIC_RELEASE);
+	if (numRecvQueues == 1 && pthread_create(&receiver, NULL, receiverMain, NULL)) {
+		perror("Starting receive thread");
+		exit(-1);
+	}
+}
+
+static struct recvQueue* recvQueueOf(int sock) {
+	for (int i = 0; i < numRecvQueues; i++) {
+		if (recvQueues[i].sock == sock) return &recvQueues[i];
+	}
+	return NULL;
+}
+
+static int sendNow(int sock, const void* buf, int len, const struct sockaddr_in* to) {
+	int n = sendto(sock, buf, len, 0, (const struct sockaddr*) to, sizeof(*to));
+	if (n != len) {
+		perror("Error sending message");
+		return -1;
+	}
+	return n;
+}
+
+static int syncRecv(int sock, void* buf, int buflen, struct sockaddr_in* from) {
+	socklen_t addrLen = sizeof(*from);
+	int n = recvfrom(sock, buf, buflen, MSG_DONTWAIT | MSG_TRUNC,
+		(struct sockaddr*) from, from ? &addrLen : NULL);
+	if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) perror("Receive packet error");
+	return n < 0 ? -1 : n;
+}
+
+#ifdef TXIO_HAVE_URING
+
+#define RING_ENTRIES 64
+#define MAX_SENDS 32
+
+enum opKind {
+	OP_RECV = 1,
+	OP_SEND,
+	OP_FSYNC
+};
+
+#define OP_DATA(kind, idx) (((uint64_t) (kind) << 32) | (uint32_t) (idx))
+
+static struct {
+	int fd;
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	unsigned sqEntries;
+	unsigned toSubmit;
+} ring;
+
+struct recvSlot {
+	int sock;
+	int ready;  // -1 while the receive is in flight, otherwise the length
+	struct sockaddr_in from;
+	struct msghdr hdr;
+	struct iovec iov;
+	char buf[TXIO_MAX_DATAGRAM];
+};
+
+struct sendSlot {
+	int inUse;
+	struct sockaddr_in to;
+	struct msghdr hdr;
+	struct iovec iov;
+	void* data;
+};
+
+static struct recvSlot* recvSlots[MAX_WATCHED];
+static int numWatched = 0;
+static struct sendSlot sendSlots[MAX_SENDS];
+static int fsyncInFlight = 0;
+static uint64_t fsyncSeq = 0;  // sequence covered by the fsync in flight
+
+static int uringSetup() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (ring.fd < 0) return -1;
+
+	size_t sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	size_t cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqLen > sqLen) sqLen = cqLen;
+
+	char* sq = mmap(NULL, sqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) goto fail;
+	char* cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cqLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring.fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) goto fail;
+	}
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) goto fail;
+
+	ring.sqHead = (unsigned*) (sq + p.sq_off.head);
+	ring.sqTail = (unsigned*) (sq + p.sq_off.tail);
+	ring.sqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring.sqArray = (unsigned*) (sq + p.sq_off.array);
+	ring.cqHead = (unsigned*) (cq + p.cq_off.head);
+	ring.cqTail = (unsigned*) (cq + p.cq_off.tail);
+	ring.cqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+	ring.sqEntries = p.sq_entries;
+	return 0;
+
+fail:
+	close(ring.fd);
+	return -1;
+}
+
+static void uringSubmit() {
+	while (ring.toSubmit) {
+		int n = syscall(__NR_io_uring_enter, ring.fd, ring.toSubmit, 0, 0, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+			perror("io_uring submit");
+			exit(-1);
+		}
+		ring.toSubmit -= n;
+	}
+}
+
+static void reap();
+
+static struct io_uring_sqe* getSqe() {
+	unsigned tail = *ring.sqTail;
+	while (tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries) {
+		uringSubmit();
+		reap();
+	}
+	unsigned idx = tail & *ring.sqMask;
+	struct io_uring_sqe* sqe = &ring.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sqArray[idx] = idx;
+	__atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring.toSubmit++;
+	return sqe;
+}
+
+static void queueRecv(int idx) {
+	struct recvSlot* slot = recvSlots[idx];
+	memset(&slot->hdr, 0, sizeof(slot->hdr));
+	slot->iov.iov_base = slot->buf;
+	slot->iov.iov_len = sizeof(slot->buf);
+	slot->hdr.msg_name = &slot->from;
+	slot->hdr.msg_namelen = sizeof(slot->from);
+	slot->hdr.msg_iov = &slot->iov;
+	slot->hdr.msg_iovlen = 1;
+	slot->ready = -1;
+
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = slot->sock;
+	sqe->addr = (uint64_t) (uintptr_t) &slot->hdr;
+	sqe->len = 1;
+	sqe->user_data = OP_DATA(OP_RECV, idx);
+}
+
+static void queueFsync() {
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = logFD;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	sqe->user_data = OP_DATA(OP_FSYNC, 0);
+	fsyncInFlight = 1;
+	fsyncSeq = flushSeq;
+}
+
+static int uringSend(int sock, const void* buf, int len, const struct sockaddr_in* to) {
+	int idx;
+	for (idx = 0; idx < MAX_SENDS && sendSlots[idx].inUse; idx++);
+	if (idx == MAX_SENDS) {
+		uringSubmit();
+		reap();
+		for (idx = 0; idx < MAX_SENDS && sendSlots[idx].inUse; idx++);
+		if (idx == MAX_SENDS) return sendNow(sock, buf, len, to);
+	}
+	struct sendSlot* slot = &sendSlots[idx];
+	slot->data = malloc(len);
+	if (!slot->data) return sendNow(sock, buf, len, to);
+	memcpy(slot->data, buf, len);
+	slot->to = *to;
+	slot->iov.iov_base = slot->data;
+	slot->iov.iov_len = len;
+	memset(&slot->hdr, 0, sizeof(slot->hdr));
+	slot->hdr.msg_name = &slot->to;
+	slot->hdr.msg_namelen = sizeof(slot->to);
+	slot->hdr.msg_iov = &slot->iov;
+	slot->hdr.msg_iovlen = 1;
+	slot->inUse = 1;
+
+	struct io_uring_sqe* sqe = getSqe();
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t) (uintptr_t) &slot->hdr;
+	sqe->len = 1;
+	sqe->user_data = OP_DATA(OP_SEND, idx);
+	uringSubmit();
+	return len;
+}
+
+static void completeFsync(int res) {
+	if (res < 0) {
+		errno = -res;
+		perror("Log sync problem");
+		exit(-1);
+	}
+	fsyncInFlight = 0;
+	setDurableSeq(fsyncSeq);
+	// Changes made while this sync was running need another one. Nothing
+	// else may submit soon: receives that arrive through shared memory
+	// never touch the ring.
+	if (flushSeq > fsyncSeq) {
+		queueFsync();
+		uringSubmit();
+	}
+}
+
+static void reap() {
+	unsigned head = *ring.cqHead;
+	unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+		int idx = (uint32_t) cqe->user_data;
+		switch (cqe->user_data >> 32) {
+			case OP_RECV:
+				if (cqe->res >= 0) {
+					recvSlots[idx]->ready = cqe->res;
+				} else {
+					if (cqe->res != -EINTR && cqe->res != -EAGAIN) {
+						errno = -cqe->res;
+						perror("Receive packet error");
+					}
+					queueRecv(idx);
+				}
+				break;
+			case OP_SEND:
+				if (cqe->res < 0) {
+					errno = -cqe->res;
+					perror("Error sending message");
+				}
+				free(sendSlots[idx].data);
+				sendSlots[idx].inUse = 0;
+				break;
+			case OP_FSYNC:
+				completeFsync(cqe->res);
+				break;
+		}
+	}
+	__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+}
+
+#endif /* TXIO_HAVE_URING */
+
+void txioInit(int fd, void* base, size_t len) {
+	logFD = fd;
+	logBase = base;
+	logLen = len;
+	backend = TXIO_SYNC;
+	shmInit();
+#ifdef TXIO_HAVE_URING
+	const char* want = getenv("TXIO_BACKEND");
+	if (!(want && strcmp(want, "sync") == 0) && uringSetup() == 0) backend = TXIO_URING;
+#endif
+
+	const char* mode = getenv("TXIO_LOG");
+	if (mode && strcmp(mode, "inline") == 0) logMode = TXIO_LOG_INLINE;
+	else if (mode && strcmp(mode, "thread") == 0) logMode = TXIO_LOG_THREAD;
+	else logMode = backend == TXIO_URING ? TXIO_LOG_URING : TXIO_LOG_THREAD;
+	if (logMode == TXIO_LOG_URING && backend != TXIO_URING) logMode = TXIO_LOG_THREAD;
+	if (logMode == TXIO_LOG_THREAD) startLogWriter();
+
+	const char* level = getenv("TXIO_DURABILITY");
+	if (level && strcmp(level, "group") == 0) durability = TXIO_DURABLE_GROUP;
+	else if (level && strcmp(level, "os") == 0) durability = TXIO_DURABLE_OS;
+	else durability = TXIO_DURABLE_STRICT;
+	const char* ms = getenv("TXIO_GROUP_MS");
+	if (ms && atoi(ms) >= 0) groupMs = atoi(ms);
+	const char* records = getenv("TXIO_GROUP_RECORDS");
+	if (records && atoi(records) > 0) groupRecords = atoi(records);
+}
+
+const char* txioBackendName() {
+	if (backend != TXIO_URING) return "sync";
+	// the receive thread reads with poll and recvfrom, so the ring only
+	// carries the log and sends
+	return receiveThread ? "io_uring (log and sends; receive thread reads)" : "io_uring";
+}
+
+const char* txioLogModeName() {
+	static const char* names[] = { "inline", "writer thread", "io_uring" };
+	return names[logMode];
+}
+
+const char* txioDurabilityName() {
+	static char name[64];
+	switch (durability) {
+		case TXIO_DURABLE_GROUP:
+			snprintf(name, sizeof(name), "group, every %d ms or %d records", groupMs, groupRecords);
+			return name;
+		case TXIO_DURABLE_OS:
+			return "os";
+		default:
+			return "strict";
+	}
+}
+
+const char* txioLocalName() {
+	return shmEnabled() ? "shared memory" : "UDP";
+}
+
+void txioReceiveThread() {
+	const char* mode = getenv("TXIO_RECV");
+	receiveThread = !(mode && strcmp(mode, "inline") == 0);
+}
+
+const char* txioReceiveName() {
+	return receiveThread ? "receive thread" : "inline";
+}
+
+void txioRecvStats(int sock, struct txioRecvStats* stats) {
+	memset(stats, 0, sizeof(*stats));
+	const struct recvQueue* q = recvQueueOf(sock);
+	if (!q) return;
+	stats->received = __atomic_load_n(&q->received, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n(&q->dropped, __ATOMIC_RELAXED);
+	stats->depth = stats->received - q->taken;
+	stats->maxDepth = __atomic_load_n(&q->maxDepth, __ATOMIC_RELAXED);
+}
+
+void txioWatch(int sock) {
+	shmWatch(sock);
+	if (receiveThread) {
+		addRecvQueue(sock);
+		return;
+	}
+#ifdef TXIO_HAVE_URING
+	if (backend != TXIO_URING) return;
+	if (numWatched == MAX_WATCHED) {
+		printf("Too many sockets for the io_uring backend\n");
+		exit(-1);
+	}
+	struct recvSlot* slot = malloc(sizeof(*slot));
+	if (!slot) {
+		perror("Allocating receive buffer");
+		exit(-1);
+	}
+	slot->sock = sock;
+	recvSlots[numWatched] = slot;
+	queueRecv(numWatched++);
+	uringSubmit();
+#endif
+}
+
+static int socketRecv(int sock, void* buf, int buflen, struct sockaddr_in* from) {
+	if (receiveThread) {
+		struct recvQueue* q = recvQueueOf(sock);
+		return q ? popDatagram(q, buf, buflen, from) : -1;
+	}
+#ifdef TXIO_HAVE_URING
+	if (backend == TXIO_URING) {
+		reap();
+		for (int i = 0; i < numWatched; i++) {
+			struct recvSlot* slot = recvSlots[i];
+			if (slot->sock != sock) continue;
+			if (slot->ready < 0) break;
+			int n = slot->ready;
+			memcpy(buf, slot->buf, n < buflen ? n : buflen);
+			if (from) *from = slot->from;
+			queueRecv(i);
+			uringSubmit();
+			return n;
+		}
+		return -1;
+	}
+#endif
+	return syncRecv(sock, buf, buflen, from);
+}
+
+int txioRecv(int sock, void* buf, int buflen, struct sockaddr_in* from) {
+	// take turns, so neither local nor remote senders can crowd out the other
+	static int socketFirst;
+	socketFirst = !socketFirst;
+	struct sockaddr_in sender;
+	if (!from) from = &sender;
+	int n = socketFirst ? socketRecv(sock, buf, buflen, from) : shmRecv(sock, buf, buflen, from);
+	if (n < 0) n = socketFirst ? shmRecv(sock, buf, buflen, from) : socketRecv(sock, buf, buflen, from);
+	if (n >= 0 && captureEnabled()) captureDatagram(sock, buf, n < buflen ? n : buflen, from);
+	return n;
+}
+
+int txioSend(int sock, const void* buf, int len, const struct sockaddr_in* to) {
+	if (shmSend(sock, buf, len, to) == len) return len;
+#ifdef TXIO_HAVE_URING
+	if (backend == TXIO_URING) return uringSend(sock, buf, len, to);
+#endif
+	return sendNow(sock, buf, len, to);
+}
+
+/**
+ * Start making the range of the mapping at off durable, the way logMode
+ * says.
+ */
+static void syncLog(size_t off, size_t len) {
+	flushSeq++;
+	switch (logMode) {
+		case TXIO_LOG_INLINE:
+			syncRange(off, len);
+			setDurableSeq(flushSeq);
+			break;
+		case TXIO_LOG_THREAD:
+			enqueueLogRecord(off, len);
+			break;
+		case TXIO_LOG_URING:
+#ifdef TXIO_HAVE_URING
+			if (!fsyncInFlight) {
+				queueFsync();
+				uringSubmit();
+			}
+#endif
+			break;
+	}
+}
+
+static void syncGroup() {
+	if (!group.records) return;
+	syncLog(group.lo, group.hi - group.lo);
+	group.records = 0;
+}
+
+void txioFlushRange(const void* p, size_t len) {
+	const size_t off = (const char*) p - (const char*) logBase;
+	switch (durability) {
+		case TXIO_DURABLE_STRICT:
+			syncLog(off, len);
+			break;
+		case TXIO_DURABLE_GROUP:
+			if (!group.records) {
+				group.lo = off;
+				group.hi = off + len;
+				group.start = nowMs();
+			}
+			if (off < group.lo) group.lo = off;
+			if (off + len > group.hi) group.hi = off + len;
+			if (++group.records >= groupRecords) syncGroup();
+			break;
+		case TXIO_DURABLE_OS:
+			break;
+	}
+}
+
+void txioFlush() {
+	txioFlushRange(logBase, logLen);
+}
+
+void txioOnDurable(void (*fn)(void*), void* arg) {
+	// the open group gets the next sequence number when it is synced
+	const uint64_t seq = flushSeq + (group.records > 0);
+	// callbacks run in the order they were queued, even once all are due
+	if (!pendingHead && getDurableSeq() >= seq) {
+		fn(arg);
+		return;
+	}
+	struct pending* p = malloc(sizeof(*p));
+	if (!p) {
+		perror("Queueing durability callback");
+		exit(-1);
+	}
+	p->next = NULL;
+	p->seq = seq;
+	p->fn = fn;
+	p->arg = arg;
+	if (pendingTail) pendingTail->next = p;
+	else pendingHead = p;
+	pendingTail = p;
+}
+
+static void sendWhenDurable(void* arg) {
+	struct durableSend* d = arg;
+	txioSend(d->sock, d->data, d->len, &d->to);
+	free(d);
+}
+
+void txioSendDurable(int sock, const void* buf, int len, const struct sockaddr_in* to) {
+	if (durability != TXIO_DURABLE_STRICT || getDurableSeq() >= flushSeq) {
+		txioSend(sock, buf, len, to);
+		return;
+	}
+	struct durableSend* d = malloc(sizeof(*d) + len);
+	if (!d) {
+		perror("Queueing reply");
+		exit(-1);
+	}
+	d->sock = sock;
+	d->len = len;
+	d->to = *to;
+	memcpy(d->data, buf, len);
+	txioOnDurable(sendWhenDurable, d);
+}
+
+void txioPoll() {
+	if (group.records && nowMs() - group.start >= groupMs) syncGroup();
+#ifdef TXIO_HAVE_URING
+	if (backend == TXIO_URING) reap();
+#endif
+	uint64_t durable = getDurableSeq();
+	while (pendingHead && pendingHead->seq <= durable) {
+		struct pending* p = pendingHead;
+		pendingHead = p->next;
+		if (!pendingHead) pendingTail = NULL;
+		p->fn(p->arg);
+		free(p);
+	}
+}
+
+void txioDrain() {
+	syncGroup();
+	while (getDurableSeq() < flushSeq) {
+#ifdef TXIO_HAVE_URING
+		if (logMode == TXIO_LOG_URING) {
+			syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			reap();
+			continue;
+		}
+#endif
+		sched_yield();
+	}
+	txioPoll();
+}
@@ -0,0 +1,152 @@
+#ifndef TXIO_H
+#define TXIO_H 1
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Network and log I/O shared by tmanager and tworker. Every datagram and
+// every log flush goes through here so the process can run either on plain
+// recvfrom/sendto/msync or on an io_uring where receives, sends and log
+// syncs are submitted asynchronously and finished from completions.
+//
+// Datagrams to processes on the same host that use txio too go through
+// shared-memory rings (shmring.h) instead of the loopback stack, unless
+// TXIO_SHM=off is set.
+//
+// Log syncs never run on the caller's thread unless TXIO_LOG=inline: they
+// go to the io_uring, or to a log writer thread that batches every record
+// queued while its previous sync was running.
+//
+// A process can have a receive thread drain its sockets into one lock-free
+// queue per socket as soon as datagrams arrive, so that a burst that comes
+// in while the caller is busy is queued instead of overrunning the socket
+// buffer. txioRecv then takes datagrams from the queue, in arrival order.
+//
+// TXIO_DURABILITY trades safety against machine crashes for throughput. A
+// process crash loses nothing in any mode, since the log is a shared
+// mapping and the page cache outlives the process.
+//   strict  every flush is synced, and durable sends wait for the sync
+//   group   flushes are synced together once TXIO_GROUP_MS have passed or
+//           TXIO_GROUP_RECORDS have piled up; durable sends go out at once,
+//           so a machine crash can lose what was announced in that window
+//   os      nothing is synced, the kernel writes the log back when it sees
+//           fit; durable sends go out at once
+
+#define TXIO_MAX_DATAGRAM 65536
+#define TXIO_GROUP_MS 10       // default longest wait of a flush for its group sync
+#define TXIO_GROUP_RECORDS 64  // default flushes per group sync
+
+enum txioBackend {
+	TXIO_SYNC = 0,
+	TXIO_URING
+};
+
+enum txioLogMode {
+	TXIO_LOG_INLINE = 0,
+	TXIO_LOG_THREAD,
+	TXIO_LOG_URING
+};
+
+enum txioDurability {
+	TXIO_DURABLE_STRICT = 0,
+	TXIO_DURABLE_GROUP,
+	TXIO_DURABLE_OS
+};
+
+struct txioRecvStats {
+	uint64_t received;  // datagrams the receive thread queued
+	uint64_t dropped;   // datagrams that found the queue full
+	uint32_t depth;     // datagrams queued and not taken yet
+	uint32_t maxDepth;  // deepest the queue has been
+};
+
+/**
+ * Set up the I/O layer. base/len is the mapping of logFD that holds the
+ * durable state of the process. io_uring is used when the kernel supports
+ * it unless TXIO_BACKEND=sync is set in the environment; otherwise the
+ * synchronous path is used. TXIO_LOG=inline|thread picks how log syncs are
+ * run; by default they follow the backend, with a writer thread standing in
+ * for io_uring.
+ */
+void txioInit(int logFD, void* base, size_t len);
+
+const char* txioBackendName(void);
+const char* txioLogModeName(void);
+const char* txioDurabilityName(void);
+const char* txioReceiveName(void);
+
+/**
+ * Receive on the sockets watched from now on with a receive thread, unless
+ * TXIO_RECV=inline is set in the environment. Must be called before
+ * txioWatch. The thread receives with recvfrom, so with it on io_uring only
+ * carries log syncs and sends. Only the thread that calls txioRecv may use the other txio
+ * functions.
+ */
+void txioReceiveThread(void);
+
+/**
+ * Counters of the receive queue of sock, all 0 without a receive thread.
+ * Datagrams from local peers over shared memory are not queued and not
+ * counted.
+ */
+void txioRecvStats(int sock, struct txioRecvStats* stats);
+const char* txioLocalName(void);
+
+/**
+ * Start listening on sock, which must already be bound. Must be called once
+ * per socket before txioRecv.
+ */
+void txioWatch(int sock);
+
+/**
+ * Non-blocking receive. Returns the length of the datagram copied into buf
+ * (truncated to buflen), or -1 if nothing was pending.
+ */
+int txioRecv(int sock, void* buf, int buflen, struct sockaddr_in* from);
+
+/**
+ * Send a datagram right away. Returns -1 if it could not be sent.
+ */
+int txioSend(int sock, const void* buf, int len, const struct sockaddr_in* to);
+
+/**
+ * Make every change made so far to the mapped log durable. The sync runs in
+ * the background unless TXIO_LOG=inline and this returns immediately.
+ */
+void txioFlush(void);
+
+/**
+ * Like txioFlush, but only the len bytes of the mapping at p need to reach
+ * the disk.
+ */
+void txioFlushRange(const void* p, size_t len);
+
+/**
+ * Call fn(arg) from txioPoll once everything flushed before this call is
+ * durable, or right away if it already is and no earlier callback is still
+ * queued. Callbacks, and so durable sends, run in the order they were
+ * queued. Unlike durable sends, this waits for the group sync with
+ * TXIO_DURABILITY=group.
+ */
+void txioOnDurable(void (*fn)(void*), void* arg);
+
+/**
+ * Send a datagram once everything flushed before this call is durable.
+ * Used for replies that other nodes are allowed to act upon. Only strict
+ * durability holds them back.
+ */
+void txioSendDurable(int sock, const void* buf, int len, const struct sockaddr_in* to);
+
+/**
+ * Reap completions and release replies whose log records are durable.
+ * Must be called regularly from the main loop.
+ */
+void txioPoll(void);
+
+/**
+ * Block until all flushes and durable sends issued so far are done, syncing
+ * a group that is still open.
+ */
+void txioDrain(void);
+
+#endif /* TXIO_H */
@@ -0,0 +1,381 @@
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "tmanager.h"
+#include "trace.h"
+#include "tworker.h"
+
+// Prints the logs of tmanager (TXMG_<port>.log) and tworker
+// (TXworker_<port>.log) without starting either. Each log is mapped read
+// only and checked field by field, and against its checksums, as it is
+// walked once front to back, so a log that is being written to or was left
+// half-written by a crash can be looked at safely. Transactions can be
+// picked by state and tid range, which makes it quick to find the ones that
+// are stuck across a directory full of logs.
+
+enum logKind { LOG_UNKNOWN, LOG_MANAGER, LOG_WORKER };
+
+static const char* onlyState;  // state name without its TX_/WTX_ prefix
+static uint32_t minTid, maxTid = UINT32_MAX;
+static int listParticipants;
+static int quiet;
+
+static int problems;  // in the log being dumped
+
+static void usage(char* cmd) {
+	printf("usage: %s [-s state] [-t tid|lo-hi] [-p] [-q] logfile...\n", cmd);
+	printf("  -s state  only transactions in state, e.g. voting or WTX_PREPARED\n");
+	printf("  -t tids   only transaction tid, or tids lo to hi\n");
+	printf("  -p        list the participants of each transaction\n");
+	printf("  -q        only report logs that fail validation\n");
+	printf("Exits with 1 if any log fails validation.\n");
+}
+
+static void problem(const char* fileName, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	printf("%s: ", fileName);
+	vprintf(fmt, ap);
+	printf("\n");
+	va_end(ap);
+	problems++;
+}
+
+/**
+ * Whether a transaction in state (a full name such as TX_VOTING) with tid
+ * passes the -s and -t filters.
+ */
+static int selected(const char* state, uint32_t tid) {
+	if (tid < minTid || tid > maxTid) return 0;
+	if (!onlyState) return 1;
+	const char* bare = strchr(state, '_');
+	return bare && !strcasecmp(bare + 1, onlyState);
+}
+
+static int filtering() {
+	return onlyState || minTid || maxTid != UINT32_MAX;
+}
+
+static const char* addrString(uint32_t addr, uint16_t netPort, char* buf, size_t len) {
+	struct in_addr a = { addr };
+	char host[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &a, host, sizeof(host));
+	snprintf(buf, len, "%s:%u", host, ntohs(netPort));
+	return buf;
+}
+
+static int countBits(const uint64_t* bits) {
+	int n = 0;
+	for (int w = 0; w < WORKER_WORDS; w++) n += __builtin_popcountll(bits[w]);
+	return n;
+}
+
+/**
+ * Whether any bit at or past from is set.
+ */
+static int bitsFrom(const uint64_t* bits, int from) {
+	for (int i = from; i < MAX_WORKERS; i++) {
+		if (i % 64 == 0 && !bits[i / 64]) {
+			i += 63;
+			continue;
+		}
+		if (bits[i / 64] & (1ull << (i % 64))) return 1;
+	}
+	return 0;
+}
+
+static void printTimer(time_t timer) {
+	if (timer == -1) return;
+	const long left = (long) (timer - time(NULL));
+	if (left >= 0) printf(", times out in %ld s", left);
+	else printf(", timed out %ld s ago", -left);
+}
+
+static void dumpManager(const char* fileName, const transactionSet* set) {
+	if (!set->initialized) {
+		if (!quiet) printf("%s: manager log, not initialized\n", fileName);
+		return;
+	}
+	if (set->nextTid && set->nextTid < LEASED_TID_BASE) {
+		problem(fileName, "next leased tid %u is below %u", set->nextTid, LEASED_TID_BASE);
+	}
+	if (!quiet) printf("%s: manager log, next leased tid %u\n", fileName, set->nextTid);
+
+	int numRegistered = set->numRegistered;
+	if (numRegistered < 0 || numRegistered > MAX_DIRECTORY) {
+		problem(fileName, "%d workers in the directory", numRegistered);
+		numRegistered = 0;
+	}
+	for (int id = 0; id < numRegistered; id++) {
+		if (set->directory[id].checksum != workerChecksum(&set->directory[id])) {
+			problem(fileName, "directory entry %d: checksum %08x, expected %08x", id,
+				set->directory[id].checksum, workerChecksum(&set->directory[id]));
+		}
+	}
+	if (!quiet) printf("  %d workers in the directory\n", numRegistered);
+
+	for (int i = 0; i < MAX_TX; i++) {
+		const transaction* tx = &set->transaction[i];
+		if (tx->tstate < TX_NOTINUSE || tx->tstate > TX_COMMITTED) {
+			problem(fileName, "slot %d: bad state %d", i, tx->tstate);
+			continue;
+		}
+		if (tx->numWorkers < 0 || tx->numWorkers > MAX_WORKERS) {
+			problem(fileName, "slot %d: %d workers", i, tx->numWorkers);
+			continue;
+		}
+		if (tx->fanout < 0 || tx->fanout > MAX_FANOUT) {
+			problem(fileName, "slot %d: fanout %d", i, tx->fanout);
+		}
+		const int voted = countBits(tx->voted);
+		const int acked = countBits(tx->acked);
+		if (bitsFrom(tx->voted, tx->numWorkers) || bitsFrom(tx->acked, tx->numWorkers)) {
+			problem(fileName, "slot %d: votes or acks past its %d workers", i, tx->numWorkers);
+		}
+		if (tx->checksum != slotChecksum(tx)) {
+			problem(fileName, "slot %d: checksum %08x, expected %08x", i, tx->checksum, slotChecksum(tx));
+		}
+		for (int w = 0; w < tx->numWorkers; w++) {
+			if (tx->workers[w] >= numRegistered) {
+				problem(fileName, "slot %d: worker %d has directory id %u, past the %d registered", i,
+					w, tx->workers[w], numRegistered);
+				break;
+			}
+		}
+		if (acked != tx->numAcks || tx->numAnswers > tx->numWorkers) {
+			problem(fileName, "slot %d: %d acks counted but %d recorded, %d answers for %d workers", i,
+				tx->numAcks, acked, tx->numAnswers, tx->numWorkers);
+		}
+
+		const char* state = traceStateName(TRACE_MANAGER, tx->tstate);
+		if (quiet || tx->tstate == TX_NOTINUSE || !selected(state, tx->txID)) continue;
+		printf("  slot %d  tid %-10lu %-14s %d workers, %d voted, %d acked", i, tx->txID, state,
+			tx->numWorkers, voted, acked);
+		if (tx->fanout) printf(", fanout %d", tx->fanout);
+		if (tx->pendingCrash) printf(", crash pending");
+		printTimer(tx->timer);
+		printf("\n");
+		if (!listParticipants) continue;
+		for (int w = 0; w < tx->numWorkers; w++) {
+			if (tx->workers[w] >= numRegistered) break;
+			const struct sockaddr_in* c = &set->directory[tx->workers[w]].client;
+			char buf[32];
+			printf("    #%-5u %s%s%s\n", tx->workers[w],
+				addrString(c->sin_addr.s_addr, c->sin_port, buf, sizeof(buf)),
+				tx->voted[w / 64] & (1ull << (w % 64)) ? " voted" : "",
+				tx->acked[w / 64] & (1ull << (w % 64)) ? " acked" : "");
+		}
+	}
+}
+
+/**
+ * The bytes of a value in the arena, or NULL (reported) if ref does not
+ * point inside it.
+ */
+static const char* arenaValue(const char* fileName, const struct logFile* log, struct slabRef ref,
+		uint32_t maxLen, const char* what) {
+	if (!ref.off && !ref.len) return "";
+	if (ref.off < SLAB_BLOCK_HEADER || ref.len > maxLen || ref.off + (uint64_t) ref.len > log->arena.top) {
+		problem(fileName, "%s at %u, %u bytes, is outside the arena", what, ref.off, ref.len);
+		return NULL;
+	}
+	return (const char*) log + LOG_ARENA_OFFSET + ref.off;
+}
+
+static void printString(const char* s, uint32_t len) {
+	putchar('"');
+	for (uint32_t i = 0; i < len && s[i]; i++) putchar(isprint((unsigned char) s[i]) ? s[i] : '?');
+	putchar('"');
+}
+
+static void dumpWorker(const char* fileName, const struct logFile* log) {
+	if (!log->initialized) {
+		if (!quiet) printf("%s: worker log, not initialized\n", fileName);
+		return;
+	}
+	const struct workerLog* lg = &log->log;
+	if (log->arena.size != LOG_ARENA_SIZE || log->arena.top > log->arena.size) {
+		problem(fileName, "arena of %u bytes with %u in use", log->arena.size, log->arena.top);
+	}
+	if (!memchr(log->txData.IDstring, 0, IDLEN)) problem(fileName, "committed id is not terminated");
+	const char* value = arenaValue(fileName, log, log->value, VALUE_MAX, "committed value");
+	const char* newID = arenaValue(fileName, log, lg->newIDstring, IDLEN, "new id");
+	const char* newValue = arenaValue(fileName, log, lg->newValue, VALUE_MAX, "new value");
+	const int stateOK = lg->txState >= WTX_NOTACTIVE && lg->txState <= WTX_IN_PROGRESS;
+	if (!stateOK) problem(fileName, "bad state %d", lg->txState);
+	const int peersOK = lg->numPeers <= MAX_PARTICIPANTS &&
+		(!lg->numPeers || lg->selfIndex < lg->numPeers) && lg->fanout <= MAX_FANOUT;
+	if (!peersOK) {
+		problem(fileName, "%u peers, self %u, fanout %u", lg->numPeers, lg->selfIndex, lg->fanout);
+	}
+	if (log->metaChecksum != logMetaChecksum(log)) {
+		problem(fileName, "metadata checksum %08x, expected %08x", log->metaChecksum, logMetaChecksum(log));
+	}
+	if (log->dataChecksum != logDataChecksum(log)) {
+		problem(fileName, "committed data checksum %08x, expected %08x", log->dataChecksum,
+			logDataChecksum(log));
+	}
+	// transactions that have not prepared are not flushed
+	if (lg->txState != WTX_INITIATED && lg->txState != WTX_IN_PROGRESS &&
+			log->txChecksum != logTxChecksum(log)) {
+		problem(fileName, "transaction checksum %08x, expected %08x", log->txChecksum, logTxChecksum(log));
+	}
+	if (log->recentNext >= RECENT_DECISIONS) problem(fileName, "recent decision ring at %u", log->recentNext);
+	for (int i = 0; i < RECENT_DECISIONS; i++) {
+		const struct recentDecision* d = &log->recent[i];
+		if (d->tid && d->outcome != TXMSG_COMMITTED && d->outcome != TXMSG_ABORTED) {
+			problem(fileName, "recent decision for tid %u has outcome %u", d->tid, d->outcome);
+		}
+	}
+	if (quiet) return;
+
+	printf("%s: worker log\n", fileName);
+	if (!filtering()) {
+		printf("  committed A=%d B=%d id ", log->txData.A, log->txData.B);
+		printString(log->txData.IDstring, IDLEN);
+		if (value) printf(" value %u bytes", log->value.len);
+		printf("\n");
+	}
+
+	const char* state = stateOK ? traceStateName(TRACE_WORKER, lg->txState) : "?";
+	if (stateOK && lg->txState != WTX_NOTACTIVE && selected(state, lg->txID)) {
+		char buf[32];
+		printf("  tid %-10lu %-16s manager %s", lg->txID, state,
+			addrString(lg->transactionManager.sin_addr.s_addr, lg->transactionManager.sin_port,
+				buf, sizeof(buf)));
+		if (lg->notify.sin_port) {
+			printf(", notify %s", addrString(lg->notify.sin_addr.s_addr, lg->notify.sin_port, buf,
+				sizeof(buf)));
+		}
+		printf("\n    writes");
+		if (!lg->newSaved) printf(" none");
+		if (lg->newSaved & 4) printf(" A=%d", lg->newA);
+		if (lg->newSaved & 2) printf(" B=%d", lg->newB);
+		if ((lg->newSaved & 1) && newID) {
+			printf(" id ");
+			printString(newID, lg->newIDstring.len);
+		}
+		if ((lg->newSaved & 8) && newValue) printf(" value %u bytes", lg->newValue.len);
+		printf("\n");
+		if (lg->numPeers && peersOK) {
+			printf("    %u peers, this worker is %u", lg->numPeers, lg->selfIndex);
+			if (lg->fanout) printf(", fanout %u", lg->fanout);
+			printf("\n");
+			for (uint32_t p = 0; listParticipants && p < lg->numPeers; p++) {
+				printf("    %s%s\n", addrString(lg->peers[p].addr, lg->peers[p].port, buf, sizeof(buf)),
+					p == lg->selfIndex ? " (self)" : "");
+			}
+		}
+	}
+
+	// Oldest first, starting from where the next decision goes.
+	for (int i = 0; i < RECENT_DECISIONS; i++) {
+		const struct recentDecision* d = &log->recent[(log->recentNext + i) % RECENT_DECISIONS];
+		if (!d->tid) continue;
+		const char* outcome = d->outcome == TXMSG_COMMITTED ? "WTX_COMMITTED" : "WTX_ABORTED";
+		if (!selected(outcome, d->tid)) continue;
+		printf("  decided tid %-10u %s\n", d->tid, outcome + 4);
+	}
+}
+
+/**
+ * Tell the kind of log by its name, falling back on its size for logs that
+ * were renamed.
+ */
+static enum logKind kindOf(const char* fileName, off_t size) {
+	const char* base = strrchr(fileName, '/');
+	base = base ? base + 1 : fileName;
+	if (!strncmp(base, "TXMG_", 5)) return LOG_MANAGER;
+	if (!strncmp(base, "TXworker_", 9)) return LOG_WORKER;
+	if (size == sizeof(transactionSet)) return LOG_MANAGER;
+	if (size == LOG_FILE_SIZE) return LOG_WORKER;
+	return LOG_UNKNOWN;
+}
+
+/**
+ * Validate and print one log. Returns the number of problems found.
+ */
+static int dump(const char* fileName) {
+	problems = 0;
+	const int fd = open(fileName, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(fileName);
+		if (fd >= 0) close(fd);
+		return 1;
+	}
+	const enum logKind kind = kindOf(fileName, st.st_size);
+	const size_t need = kind == LOG_MANAGER ? sizeof(transactionSet) : LOG_FILE_SIZE;
+	if (kind == LOG_UNKNOWN) {
+		problem(fileName, "neither a manager nor a worker log");
+	} else if (st.st_size < need) {
+		problem(fileName, "%lld bytes, a %s log has %zu", (long long) st.st_size,
+			kind == LOG_MANAGER ? "manager" : "worker", need);
+	}
+	if (problems) {
+		close(fd);
+		return problems;
+	}
+
+	void* map = mmap(NULL, need, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(fileName);
+		return 1;
+	}
+	madvise(map, need, MADV_SEQUENTIAL);
+	if (kind == LOG_MANAGER) dumpManager(fileName, map);
+	else dumpWorker(fileName, map);
+	munmap(map, need);
+	return problems;
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	char* end;
+	while ((opt = getopt(argc, argv, "s:t:pqh")) != -1) {
+		switch (opt) {
+			case 's':
+				onlyState = strchr(optarg, '_') ? strchr(optarg, '_') + 1 : optarg;
+				break;
+			case 't':
+				minTid = maxTid = strtoul(optarg, &end, 10);
+				if (*end == '-') maxTid = strtoul(end + 1, &end, 10);
+				if (*end || minTid > maxTid) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				listParticipants = 1;
+				break;
+			case 'q':
+				quiet = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int failed = 0;
+	for (int i = optind; i < argc; i++) {
+		if (dump(argv[i])) failed = 1;
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
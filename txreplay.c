@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "msg.h"
+
+// Replays captures written with TXCAPTURE=1 against fresh processes. Every
+// datagram is sent to the port it was captured on, from one socket per
+// original sender so that the receiver tells the senders apart as it did
+// then, at the original pace or faster. Replies are picked up on the same
+// sockets: a manager protocol message counts as answered when its sender
+// gets a message about the same transaction back, and the time that took
+// is its latency.
+
+#define MAX_OUTSTANDING 64  // unanswered messages tracked per sender
+
+struct datagram {
+	struct captureRecord rec;
+	char* data;
+	long order;  // position in the input, keeps sorting stable
+};
+
+struct request {
+	uint32_t tid;
+	double sent;
+};
+
+struct sender {
+	uint32_t addr;  // as captured, network byte order
+	uint16_t port;
+	int sock;
+	struct request outstanding[MAX_OUTSTANDING];
+	int numOutstanding;
+};
+
+static struct datagram* datagrams;
+static long numDatagrams, capDatagrams;
+static struct sender* senders;
+static struct pollfd* polls;
+static int numSenders, capSenders;
+static double* latencies;
+static long numLatencies, numRequests, numReplies;
+
+static double speed = 1;
+static const char* host = "localhost";
+static int portOffset = 0;
+static int waitMs = 1000;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char* cmd) {
+	printf("usage: %s [-x speed] [-H host] [-o offset] [-w ms] capturefile...\n", cmd);
+	printf("  -x speed   1 for the original pace (default), 10 for ten times as fast,\n");
+	printf("             0 for as fast as possible\n");
+	printf("  -H host    where the processes to replay against run (default localhost)\n");
+	printf("  -o offset  added to every destination port (default 0)\n");
+	printf("  -w ms      how long to wait for replies after the last datagram (default 1000)\n");
+}
+
+static void load(const char* fileName) {
+	FILE* f = fopen(fileName, "rb");
+	if (!f) {
+		perror(fileName);
+		exit(EXIT_FAILURE);
+	}
+	struct captureHeader hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic))) {
+		printf("%s: not a capture file\n", fileName);
+		exit(EXIT_FAILURE);
+	}
+
+	struct captureRecord rec;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		char* data = malloc(rec.len ? rec.len : 1);
+		if (!data || fread(data, 1, rec.len, f) != rec.len) {
+			printf("%s: truncated record\n", fileName);
+			free(data);
+			break;
+		}
+		if (numDatagrams == capDatagrams) {
+			capDatagrams = capDatagrams ? capDatagrams * 2 : 4096;
+			datagrams = realloc(datagrams, capDatagrams * sizeof(*datagrams));
+			if (!datagrams) {
+				perror("Loading capture");
+				exit(EXIT_FAILURE);
+			}
+		}
+		datagrams[numDatagrams].rec = rec;
+		datagrams[numDatagrams].data = data;
+		datagrams[numDatagrams].order = numDatagrams;
+		numDatagrams++;
+	}
+	fclose(f);
+}
+
+static int byTime(const void* a, const void* b) {
+	const struct datagram* x = a;
+	const struct datagram* y = b;
+	if (x->rec.time != y->rec.time) return x->rec.time < y->rec.time ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static int byValue(const void* a, const void* b) {
+	const double x = *(const double*) a;
+	const double y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * The socket standing in for the captured sender of d, opened on first use.
+ */
+static struct sender* senderOf(const struct datagram* d) {
+	for (int i = 0; i < numSenders; i++) {
+		if (senders[i].addr == d->rec.srcAddr && senders[i].port == d->rec.srcPort) {
+			return &senders[i];
+		}
+	}
+	if (numSenders == capSenders) {
+		capSenders = capSenders ? capSenders * 2 : 64;
+		senders = realloc(senders, capSenders * sizeof(*senders));
+		polls = realloc(polls, capSenders * sizeof(*polls));
+		if (!senders || !polls) {
+			perror("Allocating senders");
+			exit(EXIT_FAILURE);
+		}
+	}
+	struct sender* s = &senders[numSenders];
+	memset(s, 0, sizeof(*s));
+	s->addr = d->rec.srcAddr;
+	s->port = d->rec.srcPort;
+	s->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s->sock < 0) {
+		perror("Opening sender socket");
+		exit(EXIT_FAILURE);
+	}
+	polls[numSenders].fd = s->sock;
+	polls[numSenders].events = POLLIN;
+	numSenders++;
+	return s;
+}
+
+/**
+ * The transaction a manager protocol message is about, 0 for anything
+ * else: commands, read replies and outcome notifications.
+ */
+static uint32_t messageTid(const char* buf, int len) {
+	const managerType* msg = (const managerType*) buf;
+	if (len == sizeof(managerType)) return msg->tid;
+	if (len >= (int) PREPARE_SIZE(0) && msg->type == TXMSG_PREPARE_TO_COMMIT) return msg->tid;
+	return 0;
+}
+
+static void receiveReplies(struct sender* s) {
+	char buf[65536];
+	int n;
+	while ((n = recv(s->sock, buf, sizeof(buf), MSG_DONTWAIT)) >= 0) {
+		numReplies++;
+		const uint32_t tid = messageTid(buf, n);
+		if (!tid) continue;
+		for (int i = 0; i < s->numOutstanding; i++) {
+			if (s->outstanding[i].tid != tid) continue;
+			latencies[numLatencies++] = now() - s->outstanding[i].sent;
+			s->outstanding[i] = s->outstanding[--s->numOutstanding];
+			break;
+		}
+	}
+}
+
+/**
+ * Pick up replies until the time given, or only what is there already if
+ * it has passed.
+ */
+static void serviceUntil(double until) {
+	while (1) {
+		double left = until - now();
+		struct timespec timeout = { 0, 0 };
+		if (left > 0) {
+			timeout.tv_sec = (time_t) left;
+			timeout.tv_nsec = (long) ((left - timeout.tv_sec) * 1e9);
+		}
+		int ready = ppoll(polls, numSenders, &timeout, NULL);
+		if (ready > 0) {
+			for (int i = 0; i < numSenders; i++) {
+				if (polls[i].revents & POLLIN) receiveReplies(&senders[i]);
+			}
+		}
+		if (ready <= 0 && left <= 0) return;
+		if (now() >= until) return;
+	}
+}
+
+static void replay(const struct datagram* d, const struct sockaddr_in* target) {
+	struct sender* s = senderOf(d);
+	struct sockaddr_in to = *target;
+	to.sin_port = htons(d->rec.dstPort + portOffset);
+	if (sendto(s->sock, d->data, d->rec.len, 0, (struct sockaddr*) &to, sizeof(to)) < 0) {
+		perror("Sending datagram");
+		return;
+	}
+	const uint32_t tid = messageTid(d->data, d->rec.len);
+	if (!tid) return;
+	numRequests++;
+	if (s->numOutstanding == MAX_OUTSTANDING) {
+		// the oldest is not going to be answered any more
+		memmove(s->outstanding, s->outstanding + 1, (MAX_OUTSTANDING - 1) * sizeof(s->outstanding[0]));
+		s->numOutstanding--;
+	}
+	s->outstanding[s->numOutstanding].tid = tid;
+	s->outstanding[s->numOutstanding].sent = now();
+	s->numOutstanding++;
+}
+
+int main(int argc, char** argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "x:H:o:w:h")) != -1) {
+		switch (opt) {
+			case 'x':
+				speed = atof(optarg);
+				break;
+			case 'H':
+				host = optarg;
+				break;
+			case 'o':
+				portOffset = atoi(optarg);
+				break;
+			case 'w':
+				waitMs = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (optind == argc || speed < 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	struct addrinfo hints, *info;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if (getaddrinfo(host, NULL, &hints, &info)) {
+		printf("Could not look up %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+	const struct sockaddr_in target = *(struct sockaddr_in*) info->ai_addr;
+	freeaddrinfo(info);
+
+	for (int i = optind; i < argc; i++) load(argv[i]);
+	if (!numDatagrams) {
+		printf("Nothing to replay\n");
+		return EXIT_SUCCESS;
+	}
+	qsort(datagrams, numDatagrams, sizeof(*datagrams), byTime);
+	latencies = malloc(numDatagrams * sizeof(*latencies));
+	if (!latencies) {
+		perror("Allocating");
+		exit(EXIT_FAILURE);
+	}
+
+	const uint64_t base = datagrams[0].rec.time;
+	const double start = now();
+	for (long i = 0; i < numDatagrams; i++) {
+		const struct datagram* d = &datagrams[i];
+		if (speed > 0) serviceUntil(start + (d->rec.time - base) / 1e9 / speed);
+		replay(d, &target);
+		if (speed == 0) serviceUntil(0);
+	}
+	const double sendTime = now() - start;
+	serviceUntil(now() + waitMs / 1e3);
+
+	const double span = (datagrams[numDatagrams - 1].rec.time - base) / 1e9;
+	printf("Replayed %ld datagrams from %d senders in %.3f s (captured over %.3f s)\n",
+		numDatagrams, numSenders, sendTime, span);
+	printf("Throughput:  %.1f datagrams/s\n", sendTime > 0 ? numDatagrams / sendTime : 0);
+	printf("Replies:     %ld\n", numReplies);
+	printf("Answered:    %ld of %ld manager protocol messages\n", numLatencies, numRequests);
+	if (numLatencies) {
+		double sum = 0;
+		for (long i = 0; i < numLatencies; i++) sum += latencies[i];
+		qsort(latencies, numLatencies, sizeof(double), byValue);
+		printf("Latency ms:  avg %.3f  p50 %.3f  p99 %.3f  max %.3f\n", sum / numLatencies * 1e3,
+			latencies[numLatencies / 2] * 1e3, latencies[numLatencies * 99 / 100] * 1e3,
+			latencies[numLatencies - 1] * 1e3);
+	}
+	return EXIT_SUCCESS;
+}
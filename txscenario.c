@@ -0,0 +1,529 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "tworker.h"
+
+// Fault-injection scenario runner. Each scenario starts a fresh tmanager and
+// two (or more) tworkers in a scratch directory, drives a transaction through
+// the cmd protocol, injects a crash at one protocol point, restarts whatever
+// died and watches the worker logs until all workers have finished the
+// transaction.
+
+#define DEFAULT_WORKERS 2
+#define MAX_WORKERS 16
+#define SCENARIO_DEADLINE 60.0  // seconds
+#define SAMPLE_INTERVAL 1000    // microseconds
+
+enum procId {
+	PROC_MANAGER = 0,
+	PROC_WORKER1,
+	MAX_PROCS = PROC_WORKER1 + MAX_WORKERS
+};
+
+struct proc {
+	const char* name;
+	char args[2][16];
+	int nargs;
+	const char* env;  // NAME=value set for this process, or NULL
+	pid_t pid;
+	int crashes;
+	double restartAt;  // pending restart time, 0 if none
+	int held;          // set by an injection to keep the process down
+	int running;
+};
+
+struct worker {
+	unsigned long cmdPort;
+	struct logFile* log;
+	double inDoubtSince;
+	double inDoubt;
+	double done;
+};
+
+struct run {
+	double start;      // when the decision was requested
+	double lastCrash;
+	double lastRestart;
+	int numWorkers;
+	int numProcs;
+	struct proc procs[MAX_PROCS];
+	struct worker workers[MAX_WORKERS];
+};
+
+struct scenario {
+	const char* name;
+	const char* description;
+	int expect;  // 1 commit, 0 abort, -1 either as long as it is atomic
+	void (*inject)(struct run*);
+	int workers;             // 0 for DEFAULT_WORKERS
+	const char* managerEnv;  // e.g. TXFANOUT=2, or NULL
+};
+
+static char binDir[PATH_MAX];
+static unsigned long basePort = 7000;
+static double restartDelay = 0.1;
+static int cmdSock;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long managerPort() {
+	return basePort;
+}
+
+static unsigned long workerCmdPort(int w) {
+	return basePort + 1 + 2 * w;
+}
+
+static void sendCommand(int w, uint32_t kind, int32_t value, int32_t delay) {
+	msgType msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msgID = kind;
+	msg.newValue = value;
+	msg.delay = delay;
+	msg.tid = 1;
+	msg.port = managerPort();
+	strcpy(msg.strData.hostName, "localhost");
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(workerCmdPort(w));
+	if (sendto(cmdSock, &msg, sizeof(msg), 0, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		perror("Sending command");
+	}
+}
+
+static void startProc(struct proc* p) {
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		char out[64];
+		snprintf(out, sizeof(out), "%s_%s.out", p->name, p->args[0]);
+		int fd = open(out, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		if (p->env) putenv((char*) p->env);
+		char path[PATH_MAX + 16];
+		snprintf(path, sizeof(path), "%s/%s", binDir, p->name);
+		char* argv[] = { path, p->args[0], p->nargs > 1 ? p->args[1] : NULL, NULL };
+		execv(path, argv);
+		perror("exec");
+		_exit(127);
+	}
+	p->pid = pid;
+	p->running = 1;
+	p->restartAt = 0;
+}
+
+static void stopProc(struct proc* p) {
+	if (!p->running) return;
+	kill(p->pid, SIGKILL);
+	waitpid(p->pid, NULL, 0);
+	p->running = 0;
+}
+
+/**
+ * Reap processes that died and restart them once restartDelay has passed.
+ */
+static void superviseProcs(struct run* r) {
+	const double t = now();
+	for (int i = 0; i < r->numProcs; i++) {
+		struct proc* p = &r->procs[i];
+		if (p->running && waitpid(p->pid, NULL, WNOHANG) == p->pid) {
+			p->running = 0;
+			p->crashes++;
+			p->restartAt = t + restartDelay;
+			r->lastCrash = t;
+		}
+		if (!p->running && !p->held && p->restartAt && t >= p->restartAt) {
+			startProc(p);
+			r->lastRestart = now();
+		}
+	}
+}
+
+static int portFree(unsigned long port) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	int ok = bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == 0;
+	close(sock);
+	return ok;
+}
+
+/**
+ * A killed process can keep its sockets bound for a moment while the kernel
+ * tears down its io_uring, so wait for the ports before starting a run.
+ */
+static void waitPortsFree(const struct run* r) {
+	const double until = now() + 5;
+	for (unsigned long port = managerPort(); port <= workerCmdPort(r->numWorkers - 1) + 1; port++) {
+		while (!portFree(port) && now() < until) usleep(SAMPLE_INTERVAL);
+	}
+}
+
+static void killManager(struct run* r) {
+	struct proc* p = &r->procs[PROC_MANAGER];
+	kill(p->pid, SIGKILL);
+}
+
+static struct logFile* mapWorkerLog(unsigned long cmdPort) {
+	char name[64];
+	snprintf(name, sizeof(name), "TXworker_%lu.log", cmdPort);
+	int fd = open(name, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat st;
+	struct logFile* log = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size >= sizeof(struct logFile)) {
+		log = mmap(NULL, sizeof(struct logFile), PROT_READ, MAP_SHARED, fd, 0);
+		if (log == MAP_FAILED) log = NULL;
+	}
+	close(fd);
+	return log;
+}
+
+static int inDoubt(enum workerTxState state) {
+	return state == WTX_PREPARED || state == WTX_COMMITTED;
+}
+
+/**
+ * Sample the worker logs. Returns 1 once every worker is back to
+ * WTX_NOTACTIVE, i.e. has applied the outcome.
+ */
+static int sampleWorkers(struct run* r) {
+	const double t = now();
+	int finished = 0;
+	for (int w = 0; w < r->numWorkers; w++) {
+		struct worker* wk = &r->workers[w];
+		if (!wk->log) wk->log = mapWorkerLog(wk->cmdPort);
+		if (!wk->log || !wk->log->initialized) continue;
+		enum workerTxState state = wk->log->log.txState;
+		if (inDoubt(state)) {
+			if (!wk->inDoubtSince) wk->inDoubtSince = t;
+		} else if (wk->inDoubtSince) {
+			wk->inDoubt += t - wk->inDoubtSince;
+			wk->inDoubtSince = 0;
+		}
+		if (state == WTX_NOTACTIVE && !wk->done && r->start) wk->done = t;
+		if (wk->done) finished++;
+	}
+	return finished == r->numWorkers;
+}
+
+static void waitFor(struct run* r, double seconds) {
+	const double until = now() + seconds;
+	while (now() < until) {
+		superviseProcs(r);
+		sampleWorkers(r);
+		usleep(SAMPLE_INTERVAL);
+	}
+}
+
+/*
+ * Injections. Each one is called once both workers are in the transaction
+ * and have an uncommitted write, and must set r->start when it asks for the
+ * outcome.
+ */
+
+static void injectNone(struct run* r) {
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+}
+
+static void injectAbort(struct run* r) {
+	r->start = now();
+	sendCommand(0, ABORT, 0, 0);
+}
+
+static void injectCommitThenAbort(struct run* r) {
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+	// reaches the worker after it voted yes with its commit request, when
+	// the manager may already have committed
+	sendCommand(0, ABORT, 0, 0);
+}
+
+static void injectWorkerCrashActive(struct run* r) {
+	sendCommand(1, CRASH, 0, 0);
+	waitFor(r, 0.05);
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+}
+
+static void injectWorkerCrashAfterVote(struct run* r) {
+	sendCommand(1, DELAY_RESPONSE, 0, -1);
+	waitFor(r, 0.05);  // must reach the worker before PREPARE does
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+}
+
+static void injectVoteAbort(struct run* r) {
+	sendCommand(1, VOTE_ABORT, 0, 0);
+	waitFor(r, 0.05);  // must reach the worker before PREPARE does
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+}
+
+static void injectLeafVoteAbort(struct run* r) {
+	sendCommand(r->numWorkers - 1, VOTE_ABORT, 0, 0);
+	waitFor(r, 0.05);  // must reach the worker before PREPARE does
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+}
+
+static void injectInnerCrash(struct run* r) {
+	// worker 1 joins second, so it forwards PREPARE to workers 4 and 5
+	sendCommand(1, DELAY_RESPONSE, 0, -1);
+	waitFor(r, 0.05);  // must reach the worker before PREPARE does
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+}
+
+static void injectPeerKnowsOutcome(struct run* r) {
+	struct proc* w1 = &r->procs[PROC_WORKER1 + 1];
+	w1->held = 1;
+	sendCommand(1, DELAY_RESPONSE, 0, -1);
+	waitFor(r, 0.05);  // must reach the worker before PREPARE does
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+	// the vote times out and worker 0 learns the abort; only then does the
+	// manager go away for good and the in-doubt worker come back
+	while (!r->workers[0].done && now() - r->start < SCENARIO_DEADLINE) waitFor(r, 0.01);
+	r->procs[PROC_MANAGER].held = 1;
+	killManager(r);
+	w1->held = 0;
+}
+
+static void injectCommitCrash(struct run* r) {
+	r->start = now();
+	sendCommand(0, COMMIT_CRASH, 0, 0);
+}
+
+static void injectAbortCrash(struct run* r) {
+	r->start = now();
+	sendCommand(0, ABORT_CRASH, 0, 0);
+}
+
+static void injectManagerKillVoting(struct run* r) {
+	sendCommand(1, DELAY_RESPONSE, 0, 2);
+	r->start = now();
+	sendCommand(0, COMMIT, 0, 0);
+	waitFor(r, 0.5);
+	killManager(r);
+}
+
+static const struct scenario scenarios[] = {
+	{ "commit", "no fault", 1, injectNone },
+	{ "abort", "worker asks to abort", 0, injectAbort },
+	{ "commit-then-abort", "lone worker asks to abort right after asking to commit", 1,
+		injectCommitThenAbort, 1 },
+	{ "worker-crash-active", "worker crashes before commit is requested", 0,
+		injectWorkerCrashActive },
+	{ "worker-crash-voted", "worker crashes after logging its vote", -1,
+		injectWorkerCrashAfterVote },
+	{ "vote-abort", "worker votes to abort", 0, injectVoteAbort },
+	{ "commit-crash", "manager crashes after collecting the votes", -1, injectCommitCrash },
+	{ "abort-crash", "manager crashes while aborting", 0, injectAbortCrash },
+	{ "manager-kill-voting", "manager killed while waiting for a vote", -1,
+		injectManagerKillVoting },
+	{ "peer-knows-outcome", "in-doubt worker restarts while the manager is down", 0,
+		injectPeerKnowsOutcome },
+	{ "flat-commit-12", "12 workers, PREPARE sent to each by the manager", 1, injectNone, 12 },
+	{ "tree-commit-12", "12 workers, binary commit tree", 1, injectNone, 12, "TXFANOUT=2" },
+	{ "tree-vote-abort-12", "12 workers, binary commit tree, a leaf votes to abort", 0,
+		injectLeafVoteAbort, 12, "TXFANOUT=2" },
+	{ "tree-crash-inner-12", "12 workers, an inner node of the tree crashes after its vote", -1,
+		injectInnerCrash, 12, "TXFANOUT=2" },
+};
+
+#define NUM_SCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+static void setupRun(struct run* r, const struct scenario* s) {
+	memset(r, 0, sizeof(*r));
+	r->numWorkers = s->workers ? s->workers : DEFAULT_WORKERS;
+	r->numProcs = PROC_WORKER1 + r->numWorkers;
+	struct proc* m = &r->procs[PROC_MANAGER];
+	m->name = "tmanager";
+	snprintf(m->args[0], sizeof(m->args[0]), "%lu", managerPort());
+	m->nargs = 1;
+	m->env = s->managerEnv;
+	for (int w = 0; w < r->numWorkers; w++) {
+		struct proc* p = &r->procs[PROC_WORKER1 + w];
+		p->name = "tworker";
+		snprintf(p->args[0], sizeof(p->args[0]), "%lu", workerCmdPort(w));
+		snprintf(p->args[1], sizeof(p->args[1]), "%lu", workerCmdPort(w) + 1);
+		p->nargs = 2;
+		r->workers[w].cmdPort = workerCmdPort(w);
+	}
+}
+
+static void printMs(double seconds) {
+	if (seconds < 0) printf(" %12s", "-");
+	else printf(" %12.1f", seconds * 1000);
+}
+
+/**
+ * Remove the shared-memory inboxes of the run's ports. Processes that exit
+ * remove their own, but the ones stopProc killed cannot.
+ */
+static void unlinkInboxes(const struct run* r) {
+	for (unsigned long port = managerPort(); port <= workerCmdPort(r->numWorkers - 1) + 1; port++) {
+		char name[32];
+		snprintf(name, sizeof(name), "/txio.%lu", port);
+		shm_unlink(name);
+	}
+}
+
+/**
+ * Run one scenario in dir. Returns 1 if the outcome was atomic and as
+ * expected.
+ */
+static int runScenario(const struct scenario* s, const char* dir) {
+	struct run r;
+	setupRun(&r, s);
+	if (mkdir(dir, S_IRWXU) || chdir(dir)) {
+		perror(dir);
+		return 0;
+	}
+
+	waitPortsFree(&r);
+	for (int i = 0; i < r.numProcs; i++) startProc(&r.procs[i]);
+	waitFor(&r, 0.3);
+	sendCommand(0, BEGINTX, 0, 0);
+	waitFor(&r, 0.1);
+	for (int w = 1; w < r.numWorkers; w++) sendCommand(w, JOINTX, 0, 0);
+	waitFor(&r, 0.1);
+	sendCommand(0, NEW_A, 1, 0);
+	for (int w = 1; w < r.numWorkers; w++) sendCommand(w, NEW_B, 2, 0);
+	waitFor(&r, 0.1);
+
+	s->inject(&r);
+	int finished = 0;
+	while (!finished && now() - r.start < SCENARIO_DEADLINE) {
+		superviseProcs(&r);
+		finished = sampleWorkers(&r);
+		usleep(SAMPLE_INTERVAL);
+	}
+	const double end = now();
+	for (int i = 0; i < r.numProcs; i++) stopProc(&r.procs[i]);
+	unlinkInboxes(&r);
+	if (chdir("..")) perror("chdir");
+
+	double decision = 0, doubt = 0;
+	int committed[MAX_WORKERS];
+	int atomic = 1;
+	for (int w = 0; w < r.numWorkers; w++) {
+		struct worker* wk = &r.workers[w];
+		if (wk->inDoubtSince) wk->inDoubt += end - wk->inDoubtSince;
+		if (wk->inDoubt > doubt) doubt = wk->inDoubt;
+		if (wk->done - r.start > decision) decision = wk->done - r.start;
+		committed[w] = wk->log && (w == 0 ? wk->log->txData.A == 1 : wk->log->txData.B == 2);
+		if (committed[w] != committed[0]) atomic = 0;
+	}
+
+	int ok = finished && atomic && (s->expect < 0 || s->expect == committed[0]);
+	const char* outcome = !finished ? "stuck" : !atomic ? "mixed" : committed[0] ? "commit" : "abort";
+	const char* expected = s->expect < 0 ? "any" : s->expect ? "commit" : "abort";
+	int crashes = 0;
+	for (int i = 0; i < r.numProcs; i++) crashes += r.procs[i].crashes;
+
+	printf("%-22s %-7s %-7s", s->name, outcome, expected);
+	printMs(finished ? decision : -1);
+	printMs(doubt);
+	printMs(finished && crashes ? end - r.lastRestart : -1);
+	printf(" %7d  %s\n", crashes, ok ? "PASS" : "FAIL");
+	return ok;
+}
+
+static void usage(char* cmd) {
+	printf("usage: %s [-b bindir] [-p baseport] [-r restartdelay_ms] [scenario ...]\n", cmd);
+	printf("scenarios:\n");
+	for (int i = 0; i < NUM_SCENARIOS; i++) {
+		printf("  %-22s %s\n", scenarios[i].name, scenarios[i].description);
+	}
+}
+
+int main(int argc, char** argv) {
+	char self[PATH_MAX];
+	if (!realpath(argv[0], self)) {
+		perror("realpath");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(binDir, dirname(self));
+
+	int opt;
+	while ((opt = getopt(argc, argv, "b:p:r:h")) != -1) {
+		switch (opt) {
+			case 'b':
+				if (!realpath(optarg, binDir)) {
+					perror(optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'p':
+				basePort = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				restartDelay = strtoul(optarg, NULL, 10) / 1000.0;
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	cmdSock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (cmdSock < 0) {
+		perror("Could not open socket");
+		exit(EXIT_FAILURE);
+	}
+
+	char scratch[] = "/tmp/txscenario.XXXXXX";
+	if (!mkdtemp(scratch) || chdir(scratch)) {
+		perror("Creating scratch directory");
+		exit(EXIT_FAILURE);
+	}
+	printf("Binaries: %s\nScratch:  %s\n\n", binDir, scratch);
+	printf("%-22s %-7s %-7s %12s %12s %12s %7s  %s\n", "scenario", "outcome", "expect",
+		"decision ms", "in-doubt ms", "recovery ms", "crashes", "result");
+
+	int failures = 0;
+	for (int i = 0; i < NUM_SCENARIOS; i++) {
+		int selected = optind == argc;
+		for (int a = optind; a < argc; a++) {
+			if (strcmp(argv[a], scenarios[i].name) == 0) selected = 1;
+		}
+		if (selected && !runScenario(&scenarios[i], scenarios[i].name)) failures++;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
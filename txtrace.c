@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "msg.h"
+#include "trace.h"
+
+// Decoder for the binary traces written by tmanager and tworker. Reads any
+// number of trace files, merges them by timestamp and prints one timeline
+// per transaction (or a single raw timeline with -r).
+
+struct source {
+	enum traceProcKind kind;
+	unsigned port;
+};
+
+struct entry {
+	struct traceRecord rec;
+	int source;
+	long order;  // position in the input, keeps sorting stable
+};
+
+static struct source* sources;
+static struct entry* entries;
+static long numEntries, capEntries;
+
+static void usage(char* cmd) {
+	printf("usage: %s [-r] [-t tid] tracefile...\n", cmd);
+	printf("  -r      print one merged timeline instead of one per transaction\n");
+	printf("  -t tid  only show transaction tid\n");
+}
+
+static void load(const char* fileName, int src) {
+	FILE* f = fopen(fileName, "rb");
+	if (!f) {
+		perror(fileName);
+		exit(EXIT_FAILURE);
+	}
+	struct traceHeader hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))) {
+		printf("%s: not a trace file\n", fileName);
+		exit(EXIT_FAILURE);
+	}
+	sources[src].kind = hdr.kind;
+	sources[src].port = hdr.port;
+
+	struct traceRecord rec;
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		if (numEntries == capEntries) {
+			capEntries = capEntries ? capEntries * 2 : 4096;
+			entries = realloc(entries, capEntries * sizeof(*entries));
+			if (!entries) {
+				perror("Loading trace");
+				exit(EXIT_FAILURE);
+			}
+		}
+		entries[numEntries].rec = rec;
+		entries[numEntries].source = src;
+		entries[numEntries].order = numEntries;
+		numEntries++;
+	}
+	fclose(f);
+}
+
+static int byTime(const void* a, const void* b) {
+	const struct entry* x = a;
+	const struct entry* y = b;
+	if (x->rec.time != y->rec.time) return x->rec.time < y->rec.time ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void printEntry(const struct entry* e, uint64_t base) {
+	const struct source* src = &sources[e->source];
+	const struct traceRecord* rec = &e->rec;
+	char who[32];
+	snprintf(who, sizeof(who), "%s:%u", src->kind == TRACE_MANAGER ? "manager" : "worker", src->port);
+
+	printf("  %+12.3f ms  %-14s %-8s tid %-6u %-16s", (double) (rec->time - base) / 1e6, who,
+		traceEventName(rec->event), rec->tid, traceStateName(src->kind, rec->state));
+	switch (rec->event) {
+		case TR_COMMAND:
+			printf(" %s", traceCommandName(rec->arg));
+			break;
+		case TR_MSG_IN:
+		case TR_MSG_OUT:
+		case TR_IGNORED:
+			printf(" %s", traceMessageName(rec->arg));
+			break;
+		case TR_START:
+		case TR_SUSPECT:
+			printf(" port %u", rec->arg);
+			break;
+	}
+	printf("\n");
+}
+
+static int byTransaction(const void* a, const void* b) {
+	const struct entry* x = a;
+	const struct entry* y = b;
+	if (x->rec.tid != y->rec.tid) return x->rec.tid < y->rec.tid ? -1 : 1;
+	return byTime(a, b);
+}
+
+struct group {
+	long start;
+	long len;
+};
+
+static int byFirstSeen(const void* a, const void* b) {
+	return byTime(&entries[((const struct group*) a)->start],
+		&entries[((const struct group*) b)->start]);
+}
+
+static void printTime(uint64_t ns) {
+	time_t secs = ns / 1000000000;
+	char buf[64];
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&secs));
+	printf("%s.%06lu", buf, (unsigned long) (ns % 1000000000) / 1000);
+}
+
+/**
+ * Print the timeline of one transaction: len entries starting at start.
+ */
+static void printTransaction(const struct group* g) {
+	const struct entry* e = &entries[g->start];
+	uint64_t base = e[0].rec.time;
+	printf("Transaction %u, first seen ", e[0].rec.tid);
+	printTime(base);
+	printf("\n");
+	for (long i = 0; i < g->len; i++) printEntry(&e[i], base);
+	printf("  span %.3f ms\n\n", (double) (e[g->len - 1].rec.time - base) / 1e6);
+}
+
+int main(int argc, char** argv) {
+	int raw = 0, onlyTid = 0;
+	uint32_t tid = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "rt:h")) != -1) {
+		switch (opt) {
+			case 'r':
+				raw = 1;
+				break;
+			case 't':
+				onlyTid = 1;
+				tid = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (optind == argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	sources = calloc(argc - optind, sizeof(*sources));
+	for (int i = optind; i < argc; i++) load(argv[i], i - optind);
+	qsort(entries, numEntries, sizeof(*entries), byTime);
+	if (!numEntries) return EXIT_SUCCESS;
+
+	if (raw) {
+		for (long i = 0; i < numEntries; i++) {
+			if (!onlyTid || entries[i].rec.tid == tid) printEntry(&entries[i], entries[0].rec.time);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// One timeline per transaction, in order of first appearance. Records
+	// with tid 0 (startup) belong to no transaction and are skipped.
+	qsort(entries, numEntries, sizeof(*entries), byTransaction);
+	struct group* groups = malloc(numEntries * sizeof(*groups));
+	long numGroups = 0;
+	for (long i = 0; i < numEntries; i++) {
+		uint32_t t = entries[i].rec.tid;
+		if (!t || (onlyTid && t != tid)) continue;
+		if (numGroups && entries[groups[numGroups - 1].start].rec.tid == t) {
+			groups[numGroups - 1].len++;
+		} else {
+			groups[numGroups].start = i;
+			groups[numGroups++].len = 1;
+		}
+	}
+	qsort(groups, numGroups, sizeof(*groups), byFirstSeen);
+	for (long i = 0; i < numGroups; i++) printTransaction(&groups[i]);
+	return EXIT_SUCCESS;
+}